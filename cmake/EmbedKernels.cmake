@@ -0,0 +1,102 @@
+# - Embed OpenCL kernels in a C++ source file
+# Run in script mode (cmake -P). Every kernel is stored with its quoted includes
+# inlined, so the program builds without access to the kernel directory.
+#
+# Expects the following variables:
+#  KERNEL_DIR - root directory of the kernel sources
+#  KERNELS    - kernel files relative to KERNEL_DIR, separated by '|'
+#  SPIRV_DIR  - optional, directory with a <kernel>.spv for each of them
+#  OUTPUT     - the generated C++ source
+
+function(cg_inline_includes FNAME RESULT)
+    get_filename_component(dir ${FNAME} PATH)
+    file(READ ${FNAME} content)
+    string(REGEX REPLACE "#pragma once[^\n]*" "" content "${content}")
+
+    string(REGEX MATCHALL "#include[ \t]*\"[^\"]*\"" includes "${content}")
+    foreach(include ${includes})
+        string(REGEX REPLACE "#include[ \t]*\"([^\"]*)\"" "\\1" header "${include}")
+        if (EXISTS ${dir}/${header})
+            get_filename_component(header ${dir}/${header} ABSOLUTE)
+        else()
+            get_filename_component(header ${KERNEL_DIR}/${header} ABSOLUTE)
+        endif()
+
+        # same as #pragma once - each header appears only at its first include
+        set(inlined "")
+        get_property(visited GLOBAL PROPERTY CG_INLINED_HEADERS)
+        list(FIND visited ${header} found)
+        if (found EQUAL -1)
+            set_property(GLOBAL APPEND PROPERTY CG_INLINED_HEADERS ${header})
+            cg_inline_includes(${header} inlined)
+        endif()
+        string(REPLACE "${include}" "${inlined}" content "${content}")
+    endforeach()
+
+    set(${RESULT} "${content}" PARENT_SCOPE)
+endfunction()
+
+function(cg_byte_array FNAME NAME TERMINATOR RESULT)
+    file(READ ${FNAME} hex HEX)
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," bytes "${hex}")
+    set(${RESULT} "const unsigned char ${NAME}[] = { ${bytes} ${TERMINATOR} };\n" PARENT_SCOPE)
+endfunction()
+
+string(REPLACE "|" ";" kernels "${KERNELS}")
+
+set(arrays "")
+set(entries "")
+set(index 0)
+foreach(kernel ${kernels})
+    set_property(GLOBAL PROPERTY CG_INLINED_HEADERS "")
+    cg_inline_includes(${KERNEL_DIR}/${kernel} source)
+    file(WRITE ${OUTPUT}.source "${source}")
+
+    cg_byte_array(${OUTPUT}.source kSource${index} "0x00" array)
+    set(arrays "${arrays}${array}")
+    set(il "nullptr, 0")
+    if (SPIRV_DIR AND EXISTS ${SPIRV_DIR}/${kernel}.spv)
+        cg_byte_array(${SPIRV_DIR}/${kernel}.spv kIL${index} "" array)
+        set(arrays "${arrays}${array}")
+        set(il "kIL${index}, sizeof(kIL${index})")
+    endif()
+
+    set(entries "${entries}    { \"${kernel}\", { (const char *) kSource${index}, sizeof(kSource${index}) - 1, ${il} } },\n")
+    math(EXPR index "${index} + 1")
+endforeach()
+file(REMOVE ${OUTPUT}.source)
+
+file(WRITE ${OUTPUT}.tmp
+"// generated by cmake/EmbedKernels.cmake - do not edit
+
+#include \"cg_opencl/oclEmbeddedKernels.h\"
+
+namespace OCL {
+namespace EmbeddedKernels {
+
+namespace {
+${arrays}
+struct Entry {
+    const char * fname;
+    Program program;
+};
+
+const Entry kEntries[] = {
+${entries}    { nullptr, { nullptr, 0, nullptr, 0 } },
+};
+}
+
+const Program * find(const std::string & fname) {
+    for (const Entry * entry = kEntries; entry->fname; ++entry) {
+        if (fname == entry->fname) return &entry->program;
+    }
+    return nullptr;
+}
+
+}
+}
+")
+
+# keep the timestamp when nothing changed so that the library is not rebuilt
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy_if_different ${OUTPUT}.tmp ${OUTPUT})
+file(REMOVE ${OUTPUT}.tmp)
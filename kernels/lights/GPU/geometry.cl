@@ -33,3 +33,147 @@ __kernel void drawObjects(
       (int2)   (x_coord, y_coord),
       (float4) (r, g, b, a)/255.f);
 }
+
+// a cell of the new grid takes the max of the source cells it covers
+__kernel void resampleObjects(
+    __global TypeObject *dst,
+    __global TypeObject *src,
+             uint        srcX,
+             uint        srcY
+    ) {
+  const uint x_coord = get_global_id(0);
+  const uint y_coord = get_global_id(1);
+  const uint width = get_global_size(0);
+  const uint height = get_global_size(1);
+
+  const uint sx0 = x_coord*srcX/width;
+  const uint sy0 = y_coord*srcY/height;
+  const uint sx1 = max(sx0, ((x_coord + 1)*srcX - 1)/width);
+  const uint sy1 = max(sy0, ((y_coord + 1)*srcY - 1)/height);
+
+  TypeObject res = src[sy0*srcX + sx0];
+  for (uint sy = sy0; sy <= sy1; ++sy) {
+    for (uint sx = sx0; sx <= sx1; ++sx) {
+      res = max(res, src[sy*srcX + sx]);
+    }
+  }
+
+  dst[y_coord*width + x_coord] = res;
+}
+
+__kernel void applyStamps(
+    __write_only image2d_t   imgObjects,
+    __global     TypeObject *objects,
+    __global     TypeStamp  *stamps,
+                 int         nStamps,
+                 int         x0,
+                 int         y0,
+                 uint        sizeX
+    ) {
+  const int x_coord = x0 + get_global_id(0);
+  const int y_coord = y0 + get_global_id(1);
+
+  const float fx = x_coord;
+  const float fy = y_coord;
+
+  const TypeObject cur = objects[y_coord*sizeX + x_coord];
+  TypeObject res = cur;
+
+  for (int i = 0; i < nStamps; ++i) {
+    float dx = fx - stamps[i].x0;
+    float dy = fy - stamps[i].y0;
+    float r2 = stamps[i].r*stamps[i].r;
+    bool inside = false;
+
+    switch (stamps[i].type) {
+      case STAMP_CIRCLE:
+        inside = (dx*dx + dy*dy <= r2);
+        break;
+      case STAMP_RECT:
+        inside = (fx >= stamps[i].x0 && fx <= stamps[i].x1 &&
+                  fy >= stamps[i].y0 && fy <= stamps[i].y1);
+        break;
+      case STAMP_CAPSULE:
+        {
+          float sx = stamps[i].x1 - stamps[i].x0;
+          float sy = stamps[i].y1 - stamps[i].y0;
+          float t = clamp((dx*sx + dy*sy)/max(sx*sx + sy*sy, 1e-6f), 0.0f, 1.0f);
+          dx -= t*sx;
+          dy -= t*sy;
+          inside = (dx*dx + dy*dy <= r2);
+        }
+        break;
+    }
+
+    if (inside) res = stamps[i].val;
+  }
+
+  if (res == cur) return;
+
+  objects[y_coord*sizeX + x_coord] = res;
+
+  uchar a = (res > 0.0f) ? 255 : 0;
+  write_imagef(imgObjects,
+      (int2)   (x_coord, y_coord),
+      (float4) (255, 0, 0, a)/255.f);
+}
+
+// one workgroup per instance
+__kernel void drawSprites(
+    __global     TypeObject         *objects,
+    __global     TypeSpriteMask     *masks,
+    __global     float              *maskData,
+    __global     TypeSpriteInstance *instances,
+                 int                 nInstances,
+                 uint                sizeX,
+                 uint                sizeY
+    ) {
+  const uint lid = get_local_id(0);
+  const uint gid = get_group_id(0);
+
+  const uint lsize = get_local_size(0);
+
+  if (gid >= (uint) nInstances) return;
+
+  const TypeSpriteInstance inst = instances[gid];
+  const TypeSpriteMask mask = masks[inst.mask];
+
+  // the mask coordinates divide by the scales, degenerate instances cover nothing
+  if (!(inst.sx > 0.0f && inst.sy > 0.0f)) return;
+
+  float c = cos(inst.ang);
+  float s = sin(inst.ang);
+
+  float ex = fabs(c)*inst.sx + fabs(s)*inst.sy;
+  float ey = fabs(s)*inst.sx + fabs(c)*inst.sy;
+
+  int x0 = max((int)(0.5f*(inst.x0 - ex + 1.0f)*sizeX), 0);
+  int y0 = max((int)(0.5f*(inst.y0 - ey + 1.0f)*sizeY), 0);
+  int x1 = min((int)(0.5f*(inst.x0 + ex + 1.0f)*sizeX), (int)(sizeX) - 1);
+  int y1 = min((int)(0.5f*(inst.y0 + ey + 1.0f)*sizeY), (int)(sizeY) - 1);
+
+  if (x0 > x1 || y0 > y1) return;
+
+  uint nx = x1 - x0 + 1;
+  uint ny = y1 - y0 + 1;
+
+  for (uint id = lid; id < nx*ny; id += lsize) {
+    uint x_coord = id;
+    uint y_coord = x_coord/nx; x_coord -= mul24(y_coord, nx);
+    x_coord += x0;
+    y_coord += y0;
+
+    float dx = 2.0f*((float)(x_coord) + 0.5f)/sizeX - 1.0f - inst.x0;
+    float dy = 2.0f*((float)(y_coord) + 0.5f)/sizeY - 1.0f - inst.y0;
+
+    float u = ( c*dx + s*dy)/inst.sx;
+    float v = (-s*dx + c*dy)/inst.sy;
+    if (u < -1.0f || u >= 1.0f || v < -1.0f || v >= 1.0f) continue;
+
+    int mx = 0.5f*(u + 1.0f)*mask.sizeX;
+    int my = 0.5f*(v + 1.0f)*mask.sizeY;
+    if (maskData[mask.offset + my*mask.sizeX + mx] < 0.5f) continue;
+
+    objects[y_coord*sizeX + x_coord] = 1.0f;
+  }
+}
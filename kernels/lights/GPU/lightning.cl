@@ -76,12 +76,181 @@ __kernel void calcDistance(
   }
 }
 
+// the rows have different lengths, nLightAngles is the longest one
+__kernel void resetLightDistance(
+    __global   float       *lightDistance,
+    __constant TypeLight2D *lights,
+    __global   int         *lightIds,
+               int          nLightIds,
+               int          nLightAngles,
+               float        val
+    ) {
+  const uint lid = get_local_id(0);
+  const uint gid = get_group_id(0);
+
+  const uint lsize = get_local_size(0);
+  const uint ngrps = get_num_groups(0);
+
+  const uint nTotal = nLightIds*nLightAngles;
+  uint nPerGroup = (nTotal + ngrps - 1)/ngrps;
+
+  uint id = mad24(gid, nPerGroup, lid);
+  uint idmax = min(mul24((gid+1), nPerGroup), nTotal);
+
+  for (; id < idmax; id += lsize) {
+    const int k = id/nLightAngles;
+    const int i = id - k*nLightAngles;
+    const int l = lightIds[k];
+    if (i >= lights[l].nBins) continue;
+
+    lightDistance[lights[l].binOffset + i] = val;
+  }
+}
+
+bool isOccluderEdge(__global TypeObject *objects, uint x_coord, uint y_coord, uint sizeX, uint sizeY);
+
+bool isOccluderEdge(__global TypeObject *objects, uint x_coord, uint y_coord, uint sizeX, uint sizeY) {
+  if (x_coord == 0 || x_coord == sizeX - 1) return false;
+  if (y_coord == 0 || y_coord == sizeY - 1) return false;
+  if (objects[y_coord*sizeX + x_coord] < 0.5f) return false;
+  if (
+    objects[(y_coord-1)*sizeX + (x_coord)] > 0.5f &&
+    objects[(y_coord+1)*sizeX + (x_coord)] > 0.5f &&
+    objects[(y_coord)*sizeX   + (x_coord-1)] > 0.5f &&
+    objects[(y_coord)*sizeX   + (x_coord+1)] > 0.5f
+    ) return false;
+
+  return true;
+}
+
+// angular bin of the direction (dx, dy) in a row rotated by binShift bins
+int angleBin(float dy, float dx, float binShift, int nLightAngles);
+
+int angleBin(float dy, float dx, float binShift, int nLightAngles) {
+  int iang = 0.5f*(atan2pi(dy, dx) + 1.0f)*nLightAngles + binShift;
+  return (iang >= nLightAngles) ? iang - nLightAngles : iang;
+}
+
+// direction of the center of bin i
+float binAngle(int i, float binShift, int nLightAngles);
+
+float binAngle(int i, float binShift, int nLightAngles) {
+  return M_PI_F*(2.0f*((float)(i) + 0.5f - binShift)/nLightAngles - 1.0f);
+}
+
+// lights with a narrower cone spend their row on [-ang/2, ang/2] around dir instead of the full circle
+#define CONE_MAX_ANG (6.28f)
+
+bool isConeLight(__constant TypeLight2D *light);
+
+bool isConeLight(__constant TypeLight2D *light) {
+  return light->ang < CONE_MAX_ANG;
+}
+
+// half of the cone angle, in units of pi
+float coneHalfAngle(__constant TypeLight2D *light);
+
+float coneHalfAngle(__constant TypeLight2D *light) {
+  return 0.5f*M_1_PI_F*light->ang;
+}
+
+// angle of the direction (dx, dy) relative to the cone axis, in units of pi
+float coneAngle(__constant TypeLight2D *light, float dy, float dx);
+
+float coneAngle(__constant TypeLight2D *light, float dy, float dx) {
+  return atan2pi(light->dir.x*dy - light->dir.y*dx, light->dir.x*dx + light->dir.y*dy);
+}
+
+// cone bin of the relative angle rel in [-h, h]
+int coneBin(float rel, float h, float binShift, int nLightAngles);
+
+int coneBin(float rel, float h, float binShift, int nLightAngles) {
+  int iang = 0.5f*(rel + h)/h*nLightAngles + binShift;
+  return clamp(iang, 0, nLightAngles - 1);
+}
+
+// bin of the direction (dx, dy) in the row of the light, -1 if it is outside of the cone
+int lightBin(__constant TypeLight2D *light, float dy, float dx, int nLightAngles);
+
+int lightBin(__constant TypeLight2D *light, float dy, float dx, int nLightAngles) {
+  if (isConeLight(light) == false) return angleBin(dy, dx, light->binShift, nLightAngles);
+
+  float h = coneHalfAngle(light);
+  float rel = coneAngle(light, dy, dx);
+  if (fabs(rel) > h) return -1;
+
+  return coneBin(rel, h, light->binShift, nLightAngles);
+}
+
+// unit direction through the center of bin i in the row of the light
+float2 binDirection(__constant TypeLight2D *light, int i, int nLightAngles);
+
+float2 binDirection(__constant TypeLight2D *light, int i, int nLightAngles) {
+  if (isConeLight(light) == false) {
+    float ang = binAngle(i, light->binShift, nLightAngles);
+    return (float2) (cos(ang), sin(ang));
+  }
+
+  float h = coneHalfAngle(light);
+  float ang = M_PI_F*h*(2.0f*((float)(i) + 0.5f - light->binShift)/nLightAngles - 1.0f);
+  float c = cos(ang);
+  float s = sin(ang);
+  return (float2) (light->dir.x*c - light->dir.y*s, light->dir.x*s + light->dir.y*c);
+}
+
+// bins [imin, imin + cnt] (wrapping) covered by the cell as seen from the light, returns the mean squared distance
+// cnt is negative if the cell is outside of the cone of the light
+float cellBinRange(float fxmin, float fymin, float fxmax, float fymax, __constant TypeLight2D *light, int nLightAngles, int *imin, int *cnt);
+
+float cellBinRange(float fxmin, float fymin, float fxmax, float fymax, __constant TypeLight2D *light, int nLightAngles, int *imin, int *cnt) {
+  const float cx[4] = { fxmin - light->x0, fxmax - light->x0, fxmin - light->x0, fxmax - light->x0 };
+  const float cy[4] = { fymin - light->y0, fymin - light->y0, fymax - light->y0, fymax - light->y0 };
+
+  float dist = 0.0f;
+  for (int i = 0; i < 4; ++i) dist += (cx[i]*cx[i] + cy[i]*cy[i]);
+
+  if (isConeLight(light)) {
+    float h = coneHalfAngle(light);
+    float rmin = 1.0f;
+    float rmax = -1.0f;
+    for (int i = 0; i < 4; ++i) {
+      float rel = coneAngle(light, cy[i], cx[i]);
+      rmin = min(rmin, rel);
+      rmax = max(rmax, rel);
+    }
+
+    // the cell is behind the light or outside of the cone
+    *cnt = -1;
+    if (rmax - rmin > 1.0f) return 0.25f*dist;
+    if (rmin > h || rmax < -h) return 0.25f*dist;
+
+    *imin = coneBin(max(rmin, -h), h, light->binShift, nLightAngles);
+    *cnt = coneBin(min(rmax, h), h, light->binShift, nLightAngles) - *imin;
+
+    return 0.25f*dist;
+  }
+
+  int bmin = nLightAngles;
+  int bmax = 0;
+  for (int i = 0; i < 4; ++i) {
+    int iang = angleBin(cy[i], cx[i], light->binShift, nLightAngles);
+    bmin = min(bmin, iang);
+    bmax = max(bmax, iang);
+  }
+
+  *cnt = bmax - bmin;
+  *imin = bmin;
+  if (*cnt > nLightAngles/2) { *cnt = bmin + nLightAngles - bmax; *imin = bmax; }
+
+  return 0.25f*dist;
+}
+
 __kernel void calcDistance2(
     __global   TypeObject  *objects,
     __constant TypeLight2D *lights,
     __global   float       *lightDistance,
-               int          nLights,
-               int          nLightAngles,
+    __global   int         *lightIds,
+               int          nLightIds,
                uint         sizeX,
                uint         sizeY
     ) {
@@ -100,71 +269,260 @@ __kernel void calcDistance2(
     uint x_coord = id;
     uint y_coord = x_coord/sizeX; x_coord -= mul24(y_coord, sizeX);
 
-    if (x_coord == 0 || x_coord == sizeX - 1) continue;
-    if (y_coord == 0 || y_coord == sizeY - 1) continue;
-    if (objects[y_coord*sizeX + x_coord] < 0.5f) continue;
-    if (
-      objects[(y_coord-1)*sizeX + (x_coord)] > 0.5f &&
-      objects[(y_coord+1)*sizeX + (x_coord)] > 0.5f &&
-      objects[(y_coord)*sizeX   + (x_coord-1)] > 0.5f &&
-      objects[(y_coord)*sizeX   + (x_coord+1)] > 0.5f
-      ) continue;
+    if (isOccluderEdge(objects, x_coord, y_coord, sizeX, sizeY) == false) continue;
+
+    float fxmin = 2.0f*((float)(x_coord) + 0.0f)/sizeX - 1.0f;
+    float fymin = 2.0f*((float)(y_coord) + 0.0f)/sizeY - 1.0f;
+    float fxmax = 2.0f*((float)(x_coord) + 1.0f)/sizeX - 1.0f;
+    float fymax = 2.0f*((float)(y_coord) + 1.0f)/sizeY - 1.0f;
+
+    for (int k = 0; k < nLightIds; ++k) {
+      const int l = lightIds[k];
+      const int nBins = lights[l].nBins;
+      __global float *row = lightDistance + lights[l].binOffset;
+
+      int imin, cnt;
+      float dist = cellBinRange(fxmin, fymin, fxmax, fymax, lights + l, nBins, &imin, &cnt);
+
+      while (cnt >= 0) {
+        atomic_min_global(row + imin, dist);
+        ++imin; if (imin >= nBins) imin = 0;
+        --cnt;
+      }
+    }
+  }
+}
+
+// same result as calcDistance2, but the work items go over (light, cell) pairs instead
+// of cells. spreads a few lights over more work items - the autotuner picks between them
+__kernel void calcDistance2Pairs(
+    __global   TypeObject  *objects,
+    __constant TypeLight2D *lights,
+    __global   float       *lightDistance,
+    __global   int         *lightIds,
+               int          nLightIds,
+               uint         sizeX,
+               uint         sizeY
+    ) {
+  const uint lid = get_local_id(0);
+  const uint gid = get_group_id(0);
+
+  const uint lsize = get_local_size(0);
+  const uint ngrps = get_num_groups(0);
+
+  const uint nCells = sizeX*sizeY;
+  const uint nTotal = nCells*nLightIds;
+
+  // the pair count can exceed the 24 bits of mad24
+  uint nPerGroup = (nTotal + ngrps - 1)/ngrps;
+
+  uint id = gid*nPerGroup + lid;
+  uint idmax = min((gid+1)*nPerGroup, nTotal);
+
+  for (; id < idmax; id += lsize) {
+    const uint k = id/nCells;
+    uint x_coord = id - k*nCells;
+    uint y_coord = x_coord/sizeX; x_coord -= mul24(y_coord, sizeX);
+
+    if (isOccluderEdge(objects, x_coord, y_coord, sizeX, sizeY) == false) continue;
 
     float fxmin = 2.0f*((float)(x_coord) + 0.0f)/sizeX - 1.0f;
     float fymin = 2.0f*((float)(y_coord) + 0.0f)/sizeY - 1.0f;
     float fxmax = 2.0f*((float)(x_coord) + 1.0f)/sizeX - 1.0f;
     float fymax = 2.0f*((float)(y_coord) + 1.0f)/sizeY - 1.0f;
 
-    for (int l = 0; l < nLights; ++l) {
-      float dx, dy, ang, dist = 0.0f;
-      int iang, imin = nLightAngles, imax = 0;
-
-      dx = fxmin - lights[l].x0;
-      dy = fymin - lights[l].y0;
-      ang = atan2pi(dy, dx) + 1.0f;
-      iang = 0.5f*ang*nLightAngles;
-      dist += (dx*dx + dy*dy);
-      imin = iang;
-      imax = iang;
-
-      dx = fxmax - lights[l].x0;
-      dy = fymin - lights[l].y0;
-      ang = atan2pi(dy, dx) + 1.0f;
-      iang = 0.5f*ang*nLightAngles;
-      dist += (dx*dx + dy*dy);
-      imin = min(imin, iang);
-      imax = max(imax, iang);
-
-      dx = fxmin - lights[l].x0;
-      dy = fymax - lights[l].y0;
-      ang = atan2pi(dy, dx) + 1.0f;
-      iang = 0.5f*ang*nLightAngles;
-      dist += (dx*dx + dy*dy);
-      imin = min(imin, iang);
-      imax = max(imax, iang);
-
-      dx = fxmax - lights[l].x0;
-      dy = fymax - lights[l].y0;
-      ang = atan2pi(dy, dx) + 1.0f;
-      iang = 0.5f*ang*nLightAngles;
-      dist += (dx*dx + dy*dy);
-      imin = min(imin, iang);
-      imax = max(imax, iang);
-
-      dist *= 0.25f;
-
-      int cnt = imax - imin;
-      if (cnt > nLightAngles/2) { cnt = imin + nLightAngles - imax; imin = imax; }
+    const int l = lightIds[k];
+    const int nBins = lights[l].nBins;
+    __global float *row = lightDistance + lights[l].binOffset;
+
+    int imin, cnt;
+    float dist = cellBinRange(fxmin, fymin, fxmax, fymax, lights + l, nBins, &imin, &cnt);
+
+    while (cnt >= 0) {
+      atomic_min_global(row + imin, dist);
+      ++imin; if (imin >= nBins) imin = 0;
+      --cnt;
+    }
+  }
+}
+
+__kernel void resetLightDistanceWedges(
+    __global   float         *lightDistance,
+    __constant TypeLight2D   *lights,
+    __global   TypeLightWedge *wedges,
+               int            nWedges,
+               int            nLightAngles,
+               float          val
+    ) {
+  const uint lid = get_local_id(0);
+  const uint gid = get_group_id(0);
+
+  const uint lsize = get_local_size(0);
+  const uint ngrps = get_num_groups(0);
+
+  const uint nTotal = nWedges*nLightAngles;
+  uint nPerGroup = (nTotal + ngrps - 1)/ngrps;
+
+  uint id = mad24(gid, nPerGroup, lid);
+  uint idmax = min(mul24((gid+1), nPerGroup), nTotal);
+
+  for (; id < idmax; id += lsize) {
+    const int k = id/nLightAngles;
+    const int i = id - k*nLightAngles;
+    if (i >= wedges[k].binCount) continue;
+
+    const int l = wedges[k].light;
+
+    int ia = wedges[k].binStart + i;
+    if (ia >= lights[l].nBins) ia -= lights[l].nBins;
+    lightDistance[lights[l].binOffset + ia] = val;
+  }
+}
+
+// same as calcDistance2, but restricted to the cells of a region and to the bins of the given wedges
+__kernel void calcDistanceWedges(
+    __global   TypeObject     *objects,
+    __constant TypeLight2D    *lights,
+    __global   float          *lightDistance,
+    __global   TypeLightWedge *wedges,
+               int             nWedges,
+               uint            sizeX,
+               uint            sizeY,
+               uint            x0,
+               uint            y0,
+               uint            nx,
+               uint            ny
+    ) {
+  const uint lid = get_local_id(0);
+  const uint gid = get_group_id(0);
+
+  const uint lsize = get_local_size(0);
+  const uint ngrps = get_num_groups(0);
+
+  uint nPerGroup = (nx*ny + ngrps - 1)/ngrps;
+
+  uint id = mad24(gid, nPerGroup, lid);
+  uint idmax = min(mul24((gid+1), nPerGroup), nx*ny);
+
+  for (; id < idmax; id += lsize) {
+    uint x_coord = id;
+    uint y_coord = x_coord/nx; x_coord -= mul24(y_coord, nx);
+    x_coord += x0;
+    y_coord += y0;
+
+    if (isOccluderEdge(objects, x_coord, y_coord, sizeX, sizeY) == false) continue;
+
+    float fxmin = 2.0f*((float)(x_coord) + 0.0f)/sizeX - 1.0f;
+    float fymin = 2.0f*((float)(y_coord) + 0.0f)/sizeY - 1.0f;
+    float fxmax = 2.0f*((float)(x_coord) + 1.0f)/sizeX - 1.0f;
+    float fymax = 2.0f*((float)(y_coord) + 1.0f)/sizeY - 1.0f;
+
+    for (int k = 0; k < nWedges; ++k) {
+      if ((int)(x_coord) < wedges[k].x0 || (int)(x_coord) > wedges[k].x1) continue;
+      if ((int)(y_coord) < wedges[k].y0 || (int)(y_coord) > wedges[k].y1) continue;
+
+      const int l = wedges[k].light;
+      const int nBins = lights[l].nBins;
+      __global float *row = lightDistance + lights[l].binOffset;
+
+      int imin, cnt;
+      float dist = cellBinRange(fxmin, fymin, fxmax, fymax, lights + l, nBins, &imin, &cnt);
 
       while (cnt >= 0) {
-        atomic_min_global(lightDistance + l*nLightAngles + imin, dist);
-        ++imin; if (imin >= nLightAngles) imin = 0;
+        int ia = imin - wedges[k].binStart;
+        if (ia < 0) ia += nBins;
+        if (ia < wedges[k].binCount) {
+          atomic_min_global(row + imin, dist);
+        }
+        ++imin; if (imin >= nBins) imin = 0;
         --cnt;
       }
     }
   }
 }
 
+__kernel void calcDistanceSegments(
+    __global   TypeSegment *segments,
+    __constant TypeLight2D *lights,
+    __global   float       *lightDistance,
+    __global   int         *lightIds,
+               int          nSegments,
+               int          nLightIds
+    ) {
+  const uint lid = get_local_id(0);
+  const uint gid = get_group_id(0);
+
+  const uint lsize = get_local_size(0);
+  const uint ngrps = get_num_groups(0);
+
+  const uint nTotal = nSegments*nLightIds;
+  uint nPerGroup = (nTotal + ngrps - 1)/ngrps;
+
+  uint id = mad24(gid, nPerGroup, lid);
+  uint idmax = min(mul24((gid+1), nPerGroup), nTotal);
+
+  for (; id < idmax; id += lsize) {
+    const int s = id/nLightIds;
+    const int l = lightIds[id - s*nLightIds];
+    const int nBins = lights[l].nBins;
+    __global float *row = lightDistance + lights[l].binOffset;
+
+    float ax = segments[s].x0 - lights[l].x0;
+    float ay = segments[s].y0 - lights[l].y0;
+    float ex = segments[s].x1 - segments[s].x0;
+    float ey = segments[s].y1 - segments[s].y0;
+
+    int imin, cnt;
+    if (isConeLight(lights + l)) {
+      // a segment is seen under less than pi, so a wider span goes around the back of the light
+      float h = coneHalfAngle(lights + l);
+      float ra = coneAngle(lights + l, ay, ax);
+      float rb = coneAngle(lights + l, ay + ey, ax + ex);
+
+      float rmin = min(ra, rb);
+      float rmax = max(ra, rb);
+      if (rmax - rmin > 1.0f) {
+        if (rmax < h) { rmin = rmax; rmax = h; }
+        else if (rmin > -h) { rmax = rmin; rmin = -h; }
+        else continue;
+      }
+      if (rmin > h || rmax < -h) continue;
+
+      imin = coneBin(max(rmin, -h), h, lights[l].binShift, nBins);
+      cnt = coneBin(min(rmax, h), h, lights[l].binShift, nBins) - imin;
+    } else {
+      int ia = angleBin(ay, ax, lights[l].binShift, nBins);
+      int ib = angleBin(ay + ey, ax + ex, lights[l].binShift, nBins);
+
+      imin = min(ia, ib);
+      int imax = max(ia, ib);
+
+      cnt = imax - imin;
+      if (cnt > nBins/2) { cnt = imin + nBins - imax; imin = imax; }
+    }
+
+    while (cnt >= 0) {
+      if (imin >= nBins) imin -= nBins;
+
+      // intersect the ray through the bin center with the segment
+      float2 d = binDirection(lights + l, imin, nBins);
+      float dx = d.x;
+      float dy = d.y;
+
+      float den = dx*ey - dy*ex;
+      float u = (fabs(den) > 1e-12f) ? (ax*dy - ay*dx)/den : 0.0f;
+      u = clamp(u, 0.0f, 1.0f);
+
+      float px = ax + u*ex;
+      float py = ay + u*ey;
+
+      atomic_min_global(row + imin, px*px + py*py);
+      ++imin;
+      --cnt;
+    }
+  }
+}
+
 __kernel void calcShadowMap(
     __write_only image2d_t   imgShadow,
     __constant   TypeLight2D *lights,
@@ -200,13 +558,89 @@ __kernel void calcShadowMap(
   write_imagef(imgShadow, (int2) (x_coord, y_coord), (float4) (0.0f, 1.0f, 1.0f, res));
 }
 
-#define SOFT_SIZE (2)
-__kernel void calcShadowMap2(
-    __write_only image2d_t   imgShadow,
+// shading contribution of light l at (fx, fy) averaged over 2*softSize + 1 bins, negative if the point is inside the light
+float shadeLight(__constant TypeLight2D *lights, __global float *lightDistance, int l, int softSize, uint sizeX, float fx, float fy);
+
+float shadeLight(__constant TypeLight2D *lights, __global float *lightDistance, int l, int softSize, uint sizeX, float fx, float fy) {
+  float dx = fx - lights[l].x0;
+  float dy = fy - lights[l].y0;
+  float dist = (dx*dx + dy*dy);
+
+  if (dist < lights[l].size*lights[l].size) return -1.0f;
+
+  float intensity = lights[l].intensity*native_powr(1.0f + dist, -2.0f/lights[l].falloff);
+  if (intensity < 0.01f) return 0.0f;
+
+  const int nBins = lights[l].nBins;
+  __global float *row = lightDistance + lights[l].binOffset;
+
+  int iang = lightBin(lights + l, dy, dx, nBins);
+  if (iang < 0) return 0.0f;
+
+  // cone rows do not wrap, the taps past their edges are dropped
+  const bool isCone = isConeLight(lights + l);
+
+  float stot = 0.0f;
+  float wsum = 0.0f;
+  int ia = iang - softSize;
+  if (ia < 0 && isCone == false) ia += nBins;
+  for (iang = -softSize; iang <= softSize; ++iang, ++ia) {
+    if (ia >= nBins) {
+      if (isCone) break;
+      ia = 0;
+    }
+    if (ia < 0) continue;
+
+    float scur = (dist < row[ia]) ? 1.0f : max(1.0f - 50.0f*(dist - row[ia]), 0.0f);
+
+    float fd = (float)(abs(iang))/(softSize+1);
+    float wcur = max(1.0f - fd/(sizeX*lights[l].size*dist), 0.0f);
+
+    stot += scur*wcur;
+    wsum += wcur;
+  }
+
+  return intensity*stot/wsum;
+}
+
+__kernel void copyLightDistance(
+    __global   float       *dst,
+    __global   float       *src,
+    __constant TypeLight2D *lights,
+    __global   int         *lightIds,
+               int          nLightIds,
+               int          nLightAngles
+    ) {
+  const uint lid = get_local_id(0);
+  const uint gid = get_group_id(0);
+
+  const uint lsize = get_local_size(0);
+  const uint ngrps = get_num_groups(0);
+
+  const uint nTotal = nLightIds*nLightAngles;
+  uint nPerGroup = (nTotal + ngrps - 1)/ngrps;
+
+  uint id = mad24(gid, nPerGroup, lid);
+  uint idmax = min(mul24((gid+1), nPerGroup), nTotal);
+
+  for (; id < idmax; id += lsize) {
+    const int k = id/nLightAngles;
+    const int l = lightIds[k];
+    const int i = id - k*nLightAngles;
+    if (i >= lights[l].nBins) continue;
+
+    dst[lights[l].binOffset + i] = src[lights[l].binOffset + i];
+  }
+}
+
+// summed contribution of the given lights, -1 where a point is inside one of them
+__kernel void accumulateShadow(
+    __global     float       *shadow,
     __constant   TypeLight2D *lights,
     __global     float       *lightDistance,
-                 int          nLights,
-                 int          nLightAngles,
+    __global     int         *lightIds,
+                 int          nLightIds,
+                 int          softSize,
                  uint         sizeX,
                  uint         sizeY
     ) {
@@ -231,40 +665,291 @@ __kernel void calcShadowMap2(
     float fx = 2.0f*((float)(x_coord) + 0.5f)*iSizeX - 1.0f;
     float fy = 2.0f*((float)(y_coord) + 0.5f)*iSizeY - 1.0f;
 
-    float res = 0.1f;
+    float res = 0.0f;
 
-    for (int l = 0; l < nLights; ++l) {
-      float dx = fx - lights[l].x0;
-      float dy = fy - lights[l].y0;
-      float dist = (dx*dx + dy*dy);
+    for (int k = 0; k < nLightIds; ++k) {
+      float cur = shadeLight(lights, lightDistance, lightIds[k], softSize, sizeX, fx, fy);
+      if (cur < 0.0f) { res = -1.0f; break; }
+      res += cur;
+    }
 
-      if (dist < lights[l].size*lights[l].size) { res = 1.0f; break; }
+    shadow[id] = res;
+  }
+}
 
-      float intensity = lights[l].intensity*native_powr(1.0f + dist, -2.0f/lights[l].falloff);
-      if (intensity < 0.01f) continue;
+// weight of the new sample when accumulating into the history
+#define HISTORY_ALPHA (0.5f)
 
-      float ang = atan2pi(dy, dx) + 1.0f;
-      int iang = 0.5f*ang*nLightAngles;
+// largest motion of the lights that reach (fx, fy)
+float lightMotionAt(__constant TypeLight2D *lights, __global float *lightMotion, int nLights, float fx, float fy);
 
-      float stot = 0.0f;
-      float wsum = 0.0f;
-      int ia = iang - SOFT_SIZE;
-      if (ia < 0) ia += nLightAngles;
-      for (iang = -SOFT_SIZE; iang <= SOFT_SIZE; ++iang) {
-         float scur = (dist < lightDistance[l*nLightAngles + ia]) ? 1.0f : max(1.0f - 50.0f*(dist - lightDistance[l*nLightAngles + ia]), 0.0f);
+float lightMotionAt(__constant TypeLight2D *lights, __global float *lightMotion, int nLights, float fx, float fy) {
+  float motion = 0.0f;
+  for (int l = 0; l < nLights; ++l) {
+    if (lightMotion[l] <= motion) continue;
 
-         float fd = (float)(abs(iang))/(SOFT_SIZE+1);
-         float wcur = max(1.0f - fd/(sizeX*lights[l].size*dist), 0.0f);
+    float dx = fx - lights[l].x0;
+    float dy = fy - lights[l].y0;
+    float intensity = lights[l].intensity*native_powr(1.0f + dx*dx + dy*dy, -2.0f/lights[l].falloff);
+    if (intensity >= 0.01f) motion = lightMotion[l];
+  }
+  return motion;
+}
 
-         stot += scur*wcur;
-         wsum += wcur;
+// ambient term, the base of the cached lights and the given lights
+float shadePixel(__constant TypeLight2D *lights, __global float *lightDistance, __global int *lightIds, int nLightIds,
+                 int useBase, float base, int softSize, uint sizeX, float fx, float fy);
 
-        ++ia; if (ia >= nLightAngles) ia = 0;
-      }
-      res += intensity*stot/wsum;
+float shadePixel(__constant TypeLight2D *lights, __global float *lightDistance, __global int *lightIds, int nLightIds,
+                 int useBase, float base, int softSize, uint sizeX, float fx, float fy) {
+  float res = 0.1f;
+  if (useBase) {
+    if (base < 0.0f) return 1.0f;
+    res += base;
+  }
+
+  for (int k = 0; k < nLightIds; ++k) {
+    float cur = shadeLight(lights, lightDistance, lightIds[k], softSize, sizeX, fx, fy);
+    if (cur < 0.0f) return 1.0f;
+    res += cur;
+  }
+  return res;
+}
+
+__kernel void calcShadowMap2(
+    __write_only image2d_t   imgShadow,
+    __constant   TypeLight2D *lights,
+    __global     float       *lightDistance,
+    __global     int         *lightIds,
+    __global     float       *shadowBase,
+    __global     float       *shadowHistory,
+    __global     float       *lightMotion,
+                 TypeShadeParams params
+    ) {
+  const int nLightIds = params.nLightIds;
+  const int useBase   = params.useBase;
+  const int softSize  = params.softSize;
+  const int nLights   = params.nLights;
+  const uint sizeX    = params.sizeX;
+  const uint sizeY    = params.sizeY;
+  const uint x0       = params.x0;
+  const uint y0       = params.y0;
+  const uint nx       = params.nx;
+  const uint ny       = params.ny;
+  const int temporal  = params.temporal;
+  const int parity    = params.parity;
+
+  const uint lid = get_local_id(0);
+  const uint gid = get_group_id(0);
+
+  const uint lsize = get_local_size(0);
+  const uint ngrps = get_num_groups(0);
+
+  uint nPerGroup = (nx*ny + ngrps - 1)/ngrps;
+
+  uint id = mad24(gid, nPerGroup, lid);
+  uint idmax = min(mul24((gid+1), nPerGroup), nx*ny);
+
+  float iSizeX = 1.0f/sizeX;
+  float iSizeY = 1.0f/sizeY;
+
+  for (; id < idmax; id += lsize) {
+    uint x_coord = id;
+    uint y_coord = x_coord/nx; x_coord -= mul24(y_coord, nx);
+    x_coord += x0;
+    y_coord += y0;
+
+    float fx = 2.0f*((float)(x_coord) + 0.5f)*iSizeX - 1.0f;
+    float fy = 2.0f*((float)(y_coord) + 0.5f)*iSizeY - 1.0f;
+
+    const uint idx = y_coord*sizeX + x_coord;
+
+    // in accumulate mode only half of the pixels are shaded, unless a light that reaches
+    // the pixel moved - then the history is rejected in proportion to the motion
+    bool doShade = true;
+    float alpha = 1.0f;
+    if (temporal == TEMPORAL_ACCUMULATE) {
+      float motion = lightMotionAt(lights, lightMotion, nLights, fx, fy);
+      alpha = min(HISTORY_ALPHA + 0.5f*motion, 1.0f);
+      doShade = (((x_coord + y_coord) & 1) == parity) || (motion > 0.5f);
+    }
+
+    float res = 0.0f;
+    if (doShade) {
+      res = shadePixel(lights, lightDistance, lightIds, nLightIds,
+                       useBase, useBase ? shadowBase[idx] : 0.0f, softSize, sizeX, fx, fy);
+    }
+
+    if (temporal == TEMPORAL_ACCUMULATE) {
+      res = doShade ? mix(shadowHistory[idx], res, alpha) : shadowHistory[idx];
     }
+    // the shaded values also feed the upsampling
+    shadowHistory[idx] = res;
 
     write_imagef(imgShadow, (int2) (x_coord, y_coord), (float4) (0.0f, 1.0f, 1.0f, res));
   }
 
 }
+
+// joint-bilateral upsampling of the low resolution shadow map, guided by the full resolution
+// occupancy so the shadow does not bleed across occluder boundaries. pixels whose low
+// resolution neighbourhood varies by more than threshold are re-shaded at full resolution
+// with the lights and base of calcShadowMap2 - params are the ones it was run with
+__kernel void upsampleShadow(
+    __write_only image2d_t   imgOut,
+    __global     float       *shadowLow,
+    __global     TypeObject  *objects,
+    __constant   TypeLight2D *lights,
+    __global     float       *lightDistance,
+    __global     int         *lightIds,
+    __global     float       *shadowBase,
+    __global     float       *lightMotion,
+                 TypeShadeParams params,
+                 int          refine,
+                 float        threshold,
+                 uint         sizeX,
+                 uint         sizeY,
+                 uint         x0,
+                 uint         y0
+    ) {
+  const uint lowX = params.sizeX;
+  const uint lowY = params.sizeY;
+
+  const uint x_coord = get_global_id(0) + x0;
+  const uint y_coord = get_global_id(1) + y0;
+
+  // position in low resolution pixels, relative to the pixel centers
+  float lx = ((float)(x_coord) + 0.5f)*lowX/sizeX - 0.5f;
+  float ly = ((float)(y_coord) + 0.5f)*lowY/sizeY - 0.5f;
+
+  int ix0 = clamp((int)(floor(lx)), 0, (int)(lowX) - 1);
+  int iy0 = clamp((int)(floor(ly)), 0, (int)(lowY) - 1);
+  int ix1 = min(ix0 + 1, (int)(lowX) - 1);
+  int iy1 = min(iy0 + 1, (int)(lowY) - 1);
+
+  float tx = clamp(lx - ix0, 0.0f, 1.0f);
+  float ty = clamp(ly - iy0, 0.0f, 1.0f);
+
+  const float guide = objects[y_coord*sizeX + x_coord];
+
+  float vmin = 1e10f;
+  float vmax = -1e10f;
+  float vsum = 0.0f;
+  float wsum = 0.0f;
+  for (int k = 0; k < 4; ++k) {
+    int ix = (k & 1) ? ix1 : ix0;
+    int iy = (k & 2) ? iy1 : iy0;
+
+    float v = shadowLow[iy*lowX + ix];
+    vmin = min(vmin, v);
+    vmax = max(vmax, v);
+
+    // the guide value at the center of the low resolution pixel
+    uint gx = min((uint)(((float)(ix) + 0.5f)*sizeX/lowX), sizeX - 1);
+    uint gy = min((uint)(((float)(iy) + 0.5f)*sizeY/lowY), sizeY - 1);
+    float wr = (fabs(objects[gy*sizeX + gx] - guide) < 0.5f) ? 1.0f : 0.01f;
+
+    float ws = ((k & 1) ? tx : 1.0f - tx)*((k & 2) ? ty : 1.0f - ty);
+
+    vsum += ws*wr*v;
+    wsum += ws*wr;
+  }
+
+  float res = (wsum > 0.0f) ? vsum/wsum : vmin;
+
+  if (refine && vmax - vmin > threshold) {
+    float fx = 2.0f*((float)(x_coord) + 0.5f)/sizeX - 1.0f;
+    float fy = 2.0f*((float)(y_coord) + 0.5f)/sizeY - 1.0f;
+
+    // the base is only known at low resolution, the nearest pixel is used
+    int bx = clamp((int)(lx + 0.5f), 0, (int)(lowX) - 1);
+    int by = clamp((int)(ly + 0.5f), 0, (int)(lowY) - 1);
+    float base = params.useBase ? shadowBase[by*lowX + bx] : 0.0f;
+
+    float cur = shadePixel(lights, lightDistance, lightIds, params.nLightIds,
+                           params.useBase, base, params.softSize, lowX, fx, fy);
+
+    // blended into the history the same way as the low resolution pixels around it
+    if (params.temporal == TEMPORAL_ACCUMULATE) {
+      float motion = lightMotionAt(lights, lightMotion, params.nLights, fx, fy);
+      cur = mix(res, cur, min(HISTORY_ALPHA + 0.5f*motion, 1.0f));
+    }
+    res = cur;
+  }
+
+  write_imagef(imgOut, (int2) (x_coord, y_coord), (float4) (0.0f, 1.0f, 1.0f, res));
+}
+
+// reflects p into [-1, 1] as if bouncing off the borders
+float bounce(float p);
+
+float bounce(float p) {
+  float q = p + 1.0f;
+  q -= 4.0f*floor(0.25f*q);
+  return (q < 2.0f) ? q - 1.0f : 3.0f - q;
+}
+
+float2 evalLightAnim(__global TypeLightAnim *anim, __global TypeLightKey *keys, float time);
+
+float2 evalLightAnim(__global TypeLightAnim *anim, __global TypeLightKey *keys, float time) {
+  if (anim->type == LIGHT_ANIM_PATH) {
+    return (float2) (anim->pathX.x + anim->pathX.y*sin(anim->pathX.z*time + anim->pathX.w),
+                     anim->pathY.x + anim->pathY.y*sin(anim->pathY.z*time + anim->pathY.w));
+  }
+
+  if (anim->type == LIGHT_ANIM_VELOCITY) {
+    float dt = time - anim->t0;
+    return (float2) (bounce(anim->origin.x + anim->velocity.x*dt),
+                     bounce(anim->origin.y + anim->velocity.y*dt));
+  }
+
+  __global TypeLightKey *k = keys + anim->keyStart;
+  const int n = anim->nKeys;
+
+  float t = time - anim->t0;
+  t -= anim->period*floor(t/anim->period);
+
+  int i = -1;
+  while (i + 1 < n && k[i + 1].t <= t) ++i;
+
+  // before the first key the last one is interpolated from the previous period
+  int ia = (i < 0) ? n - 1 : i;
+  int ib = (i + 1 < n) ? i + 1 : 0;
+  float ta = (i < 0) ? k[ia].t - anim->period : k[ia].t;
+  float tb = (i + 1 < n) ? k[ib].t : k[ib].t + anim->period;
+
+  float u = (tb > ta) ? (t - ta)/(tb - ta) : 0.0f;
+  return (float2) (mix(k[ia].x, k[ib].x, u), mix(k[ia].y, k[ib].y, u));
+}
+
+// applies the refresh records to the lights, so a frame only uploads the records
+__kernel void animateLights(
+    __global TypeLight2D      *lights,
+    __global TypeLightAnim    *anims,
+    __global TypeLightKey     *keys,
+    __global TypeLightRefresh *refresh,
+             int               nRefresh,
+             float             time
+    ) {
+  const uint lid = get_local_id(0);
+  const uint gid = get_group_id(0);
+
+  const uint lsize = get_local_size(0);
+  const uint ngrps = get_num_groups(0);
+
+  uint nPerGroup = (nRefresh + ngrps - 1)/ngrps;
+
+  uint id = mad24(gid, nPerGroup, lid);
+  uint idmax = min(mul24((gid+1), nPerGroup), (uint)(nRefresh));
+
+  for (; id < idmax; id += lsize) {
+    const int l = refresh[id].light;
+
+    float2 p = (float2) (refresh[id].x0, refresh[id].y0);
+    if (refresh[id].animate) p = evalLightAnim(anims + l, keys, time);
+
+    lights[l].x0 = p.x;
+    lights[l].y0 = p.y;
+    lights[l].binShift = refresh[id].binShift;
+  }
+}
@@ -22,12 +22,148 @@ struct st_TypeLight2D {
   cl_float falloff;
   cl_float ang;
   cl_float intensity;
-  cl_bool active;
-  cl_uchar padding[7];
+  cl_int active;     // not cl_bool - bool has no defined size in kernels
+  cl_float binShift; // fraction of a bin the angular bins are rotated by
+  cl_int binOffset;  // start of the light's row in lightDistance
+  cl_int nBins;      // length of the light's row
 };
 
 typedef struct st_TypeLight2D TypeLight2D;
 
+#define TEMPORAL_OFF        0
+#define TEMPORAL_RESET      1
+#define TEMPORAL_ACCUMULATE 2
+
+// scalar arguments of calcShadowMap2 and upsampleShadow, passed by value as one struct.
+// the shaded rectangle is [x0, x0 + nx) x [y0, y0 + ny) of the sizeX x sizeY map
+struct st_TypeShadeParams {
+  cl_int nLightIds;
+  cl_int useBase;
+  cl_int softSize;
+  cl_int nLights;
+  cl_uint sizeX;
+  cl_uint sizeY;
+  cl_uint x0;
+  cl_uint y0;
+  cl_uint nx;
+  cl_uint ny;
+  cl_int temporal;
+  cl_int parity;
+};
+
+typedef struct st_TypeShadeParams TypeShadeParams;
+
+#define STAMP_CIRCLE  0
+#define STAMP_RECT    1
+#define STAMP_CAPSULE 2
+
+// coordinates and radius are in grid cells
+struct st_TypeStamp {
+  cl_float x0;
+  cl_float y0;
+  cl_float x1;
+  cl_float y1;
+  cl_float r;
+  cl_float val;
+  cl_int type;
+  cl_int padding;
+};
+
+typedef struct st_TypeStamp TypeStamp;
+
+// a mask is stored row-major at [offset, offset + sizeX*sizeY) in the mask data
+struct st_TypeSpriteMask {
+  cl_int offset;
+  cl_int sizeX;
+  cl_int sizeY;
+  cl_int padding;
+};
+
+typedef struct st_TypeSpriteMask TypeSpriteMask;
+
+// position and half-extents are in world coordinates, rotation in radians
+struct st_TypeSpriteInstance {
+  cl_float x0;
+  cl_float y0;
+  cl_float sx;
+  cl_float sy;
+  cl_float ang;
+  cl_int mask;
+  cl_int padding[2];
+};
+
+typedef struct st_TypeSpriteInstance TypeSpriteInstance;
+
+// end points are in world coordinates
+struct st_TypeSegment {
+  cl_float x0;
+  cl_float y0;
+  cl_float x1;
+  cl_float y1;
+};
+
+typedef struct st_TypeSegment TypeSegment;
+
+// bins [binStart, binStart + binCount) of a light (wrapping around) and the
+// grid cells [x0, x1] x [y0, y1] that can project onto them
+struct st_TypeLightWedge {
+  cl_int light;
+  cl_int binStart;
+  cl_int binCount;
+  cl_int padding;
+  cl_int x0;
+  cl_int y0;
+  cl_int x1;
+  cl_int y1;
+};
+
+typedef struct st_TypeLightWedge TypeLightWedge;
+
+#define LIGHT_ANIM_NONE      0
+#define LIGHT_ANIM_PATH      1
+#define LIGHT_ANIM_KEYFRAMES 2
+#define LIGHT_ANIM_VELOCITY  3
+
+// PATH:      x = pathX.x + pathX.y*sin(pathX.z*t + pathX.w), same for y
+// KEYFRAMES: linear between keys [keyStart, keyStart + nKeys), looping with period from t0
+// VELOCITY:  origin + velocity*(t - t0), bouncing off the borders of [-1, 1]^2
+struct st_TypeLightAnim {
+  cl_float4 pathX;
+  cl_float4 pathY;
+  cl_float2 origin;
+  cl_float2 velocity;
+  cl_float t0;
+  cl_float period;
+  cl_int type;
+  cl_int keyStart;
+  cl_int nKeys;
+  cl_int padding[3];
+};
+
+typedef struct st_TypeLightAnim TypeLightAnim;
+
+// keys of an animation are sorted by t in [0, period)
+struct st_TypeLightKey {
+  cl_float t;
+  cl_float x;
+  cl_float y;
+  cl_float padding;
+};
+
+typedef struct st_TypeLightKey TypeLightKey;
+
+// a refreshed light - it is moved to its animated position or to (x0, y0)
+struct st_TypeLightRefresh {
+  cl_int light;
+  cl_int animate;
+  cl_float binShift;
+  cl_float x0;
+  cl_float y0;
+  cl_int padding[3];
+};
+
+typedef struct st_TypeLightRefresh TypeLightRefresh;
+
 #ifndef OPENCL_KERNEL_LANGUAGE
 }
 #endif
@@ -11,10 +11,15 @@
 #include "ui.h"
 #include "geometry.h"
 
+#include "data.h"
+
 #include "imgui/imgui.h"
 
 #include <GLFW/glfw3.h>
 
+#include <cmath>
+#include <algorithm>
+
 constexpr auto kTag = "App"; 
 
 static void error_callback(int error, const char* description) {
@@ -28,6 +33,7 @@ App::App() {
 
     _ui->_nLights = _geometry->_nLights;
     _ui->_nLightAngles = _geometry->_nLightAngles;
+    _ui->_animateLights = _geometry->_animateLights;
 }
 
 App::~App() {
@@ -53,12 +59,26 @@ void App::pollEvents() {
     glfwPollEvents();
 }
 
+void App::waitEvents() {
+    glfwWaitEvents();
+}
+
 void App::processKeyboard() {
     if (ImGui::GetIO().KeysDown[GLFW_KEY_ESCAPE]) {
         _shouldTerminate = true;
     }
 
+    bool isDrawing = false;
+    float val = 0.0f;
     if (ImGui::IsMouseDown(GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS) {
+        isDrawing = true;
+        val = 1.0f;
+    } else if (ImGui::IsMouseDown(GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS) {
+        isDrawing = true;
+        val = 0.0f;
+    }
+
+    if (isDrawing) {
         auto mPos = ImGui::GetMousePos();
         if (_ui->_isFullscreen) {
             _window->toScreenCoordinates(mPos.x, mPos.y);
@@ -66,30 +86,52 @@ void App::processKeyboard() {
             _window->toViewportCordinates(0, mPos.x, mPos.y);
         }
         mPos.x = 2.0*mPos.x + 1.0;
+        _geometry->viewToWorld(mPos.x, mPos.y);
 
         int size = 10;
         if (ImGui::GetIO().KeyShift) size = 50;
         //CG_INFO(0, "Mouse pressed at %g %g\n", mPos.x, mPos.y);
 
-        _geometry->addObjectCircle(mPos.x, mPos.y, size, 1.0);
-        _geometry->updateObjectsTexture();
-    }
-    if (ImGui::IsMouseDown(GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS) {
-        auto mPos = ImGui::GetMousePos();
-        if (_ui->_isFullscreen) {
-            _window->toScreenCoordinates(mPos.x, mPos.y);
+        // connect consecutive mouse samples so fast strokes have no gaps
+        if (_wasDrawing) {
+            _geometry->stampCapsule(_lastDrawX, _lastDrawY, mPos.x, mPos.y, size, val);
         } else {
-            _window->toViewportCordinates(0, mPos.x, mPos.y);
+            _geometry->stampCircle(mPos.x, mPos.y, size, val);
         }
-        mPos.x = 2.0*mPos.x + 1.0;
+        _geometry->applyStamps();
 
-        int size = 10;
-        if (ImGui::GetIO().KeyShift) size = 50;
-        //CG_INFO(0, "Right Mouse pressed at %g %g\n", mPos.x, mPos.y);
+        _lastDrawX = mPos.x;
+        _lastDrawY = mPos.y;
+    }
+    _wasDrawing = isDrawing;
+}
 
-        _geometry->addObjectCircle(mPos.x, mPos.y, size, 0.0);
-        _geometry->updateObjectsTexture();
+void App::updateSprites() {
+    if (_spriteMask < 0) {
+        const int n = 16;
+        std::vector<float> mask(n*n, 1.0f);
+        for (int y = n/4; y < 3*n/4; ++y) {
+            for (int x = n/4; x < 3*n/4; ++x) {
+                mask[y*n + x] = 0.0f;
+            }
+        }
+        _spriteMask = _geometry->addSpriteMask(n, n, mask.data());
+    }
+
+    float t = glfwGetTime();
+    auto & instances = *_geometry->getSpriteInstances();
+    instances.resize(_ui->_nSprites);
+    for (int i = 0; i < (int) instances.size(); ++i) {
+        auto & inst = instances[i];
+        inst.x0 = 0.9*sin(0.13*t*(1 + i%7) + 2.1*i);
+        inst.y0 = 0.9*cos(0.11*t*(1 + i%5) + 1.3*i);
+        inst.sx = 0.02;
+        inst.sy = 0.01;
+        inst.ang = 0.5*t + i;
+        inst.mask = _spriteMask;
     }
+
+    _geometry->updateSprites();
 }
 
 void App::updateState() {
@@ -102,11 +144,7 @@ void App::updateState() {
 
     if (_ui->_updateGeometry) {
         CG_IDBG(0, kTag, "Updating geometry\n");
-        _geometry->_nLights = _ui->_nLights;
-        _geometry->_nLightAngles = _ui->_nLightAngles;
-        _geometry->allocate(_ui->_geometrySizeX, _ui->_geometrySizeY);
-        _geometry->updateFloorTexture();
-        _geometry->updateObjectsTexture();
+        _geometry->reconfigure(_ui->_geometrySizeX, _ui->_geometrySizeY, _ui->_nLights, _ui->_nLightAngles);
         _geometry->finishOpenCL();
     }
 
@@ -116,6 +154,41 @@ void App::updateState() {
         _geometry->updateObjectsTexture();
     }
 
+    _geometry->_animateLights = _ui->_animateLights;
+    _geometry->_lightRowBudget = _ui->_lightRowBudget;
+    _geometry->_targetFrameTime = 0.001f*_ui->_targetFrameTimeMs;
+    _geometry->_temporal = _ui->_temporal;
+    if (_geometry->_targetFrameTime <= 0.0f) {
+        _geometry->_upsample = _ui->_upsample;
+        if (_ui->_autoShadowMapScale == false) _geometry->setShadowMapScale(_ui->_shadowMapScale);
+    }
+
+    {
+        float h = 1.0f/_ui->_viewZoom;
+        float cx = std::min(std::max(_ui->_viewX, -1.0f + h), 1.0f - h);
+        float cy = std::min(std::max(_ui->_viewY, -1.0f + h), 1.0f - h);
+
+        // the scene covers the left half of the viewport
+        int nPixelsX = _ui->_autoShadowMapScale ? 0.5f*_ui->getViewportWidth() : 0;
+        _geometry->setViewRect(cx - h, cy - h, cx + h, cy + h, nPixelsX);
+    }
+    for (int l = 0; l < _geometry->_nLights; ++l) {
+        _geometry->setLightStatic(l, l < _ui->_nStaticLights);
+    }
+
+    if (_ui->_showPolygons != _showPolygons) {
+        _showPolygons = _ui->_showPolygons;
+        _geometry->clearSegments();
+        if (_showPolygons) {
+            const float box[] = { -0.6f, 0.2f, -0.3f, 0.2f, -0.3f, 0.5f, -0.6f, 0.5f };
+            const float triangle[] = { 0.2f, -0.5f, 0.6f, -0.4f, 0.3f, -0.1f };
+            const float wall[] = { -0.4f, -0.6f, 0.0f, -0.2f, 0.0f, 0.6f };
+            _geometry->addPolygon(box, 4);
+            _geometry->addPolygon(triangle, 3);
+            _geometry->addPolygon(wall, 3, false);
+        }
+    }
+
     if (_window->shouldClose()) {
         CG_IDBG(0, kTag, "Main window closed\n");
         _shouldTerminate = true;
@@ -23,8 +23,10 @@ public:
     void terminate();
 
     void pollEvents();
+    void waitEvents();
     void processKeyboard();
     void updateState();
+    void updateSprites();
 
     inline std::shared_ptr<UI> getUI() { return _ui; }
     inline std::shared_ptr<Geometry> getGeometry() { return _geometry; }
@@ -35,6 +37,13 @@ public:
     bool _shouldTerminate = false;
 
 private:
+    int _spriteMask = -1;
+    bool _showPolygons = false;
+
+    bool _wasDrawing = false;
+    float _lastDrawX = 0.0f;
+    float _lastDrawY = 0.0f;
+
     std::shared_ptr<UI> _ui;
     std::shared_ptr<Geometry> _geometry;
     std::shared_ptr<CG::Window2D> _window;
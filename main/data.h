@@ -16,4 +16,17 @@ struct Light : public CLIF::TypeLight2D {};
 struct Lights : public std::vector<Light> {};
 
 struct LightDistance : public std::vector<cl_float> {};
+struct LightIds : public std::vector<cl_int> {};
+struct LightWedges : public std::vector<CLIF::TypeLightWedge> {};
+struct LightAnims : public std::vector<CLIF::TypeLightAnim> {};
+struct LightKeys : public std::vector<CLIF::TypeLightKey> {};
+struct LightRefreshes : public std::vector<CLIF::TypeLightRefresh> {};
+
+struct Stamps : public std::vector<CLIF::TypeStamp> {};
+
+struct SpriteMasks : public std::vector<CLIF::TypeSpriteMask> {};
+struct SpriteMaskData : public std::vector<cl_float> {};
+struct SpriteInstances : public std::vector<CLIF::TypeSpriteInstance> {};
+
+struct Segments : public std::vector<CLIF::TypeSegment> {};
 }
@@ -19,6 +19,9 @@
 #endif
 
 #include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
 
 struct Geometry::Texture2D {
     Texture2D() {}
@@ -38,16 +41,551 @@ struct Geometry::Texture2D {
     GLuint glid = 0;
 };
 
+// inclusive range of grid cells
+struct Geometry::Rect {
+    static Rect make(int x0, int y0, int x1, int y1) {
+        Rect r;
+        r.x0 = x0; r.y0 = y0;
+        r.x1 = x1; r.y1 = y1;
+        return r;
+    }
+
+    bool empty() const { return x0 > x1 || y0 > y1; }
+
+    void add(const Rect & r) {
+        if (r.empty()) return;
+        if (empty()) { *this = r; return; }
+        x0 = std::min(x0, r.x0); x1 = std::max(x1, r.x1);
+        y0 = std::min(y0, r.y0); y1 = std::max(y1, r.y1);
+    }
+
+    int area() const { return empty() ? 0 : (x1 - x0 + 1)*(y1 - y0 + 1); }
+
+    // n cells more on each side, clamped to the sizeX x sizeY grid
+    Rect grow(int n, int sizeX, int sizeY) const {
+        if (empty()) return *this;
+        return make(std::max(x0 - n, 0), std::max(y0 - n, 0), std::min(x1 + n, sizeX - 1), std::min(y1 + n, sizeY - 1));
+    }
+
+    friend Rect intersect(const Rect & a, const Rect & b) {
+        return make(std::max(a.x0, b.x0), std::max(a.y0, b.y0), std::min(a.x1, b.x1), std::min(a.y1, b.y1));
+    }
+
+    int x0 = 0;
+    int y0 = 0;
+    int x1 = -1;
+    int y1 = -1;
+};
+
+namespace {
+// the kernels read the lights with the OpenCL C layout of the same struct
+static_assert(sizeof(CLIF::TypeLight2D) == 64, "TypeLight2D size differs from the kernels");
+static_assert(offsetof(CLIF::TypeLight2D, dir) == 16, "TypeLight2D layout differs from the kernels");
+static_assert(offsetof(CLIF::TypeLight2D, x0) == 24, "TypeLight2D layout differs from the kernels");
+static_assert(offsetof(CLIF::TypeLight2D, intensity) == 44, "TypeLight2D layout differs from the kernels");
+static_assert(offsetof(CLIF::TypeLight2D, active) == 48, "TypeLight2D layout differs from the kernels");
+static_assert(offsetof(CLIF::TypeLight2D, binShift) == 52, "TypeLight2D layout differs from the kernels");
+static_assert(offsetof(CLIF::TypeLight2D, binOffset) == 56, "TypeLight2D layout differs from the kernels");
+static_assert(offsetof(CLIF::TypeLight2D, nBins) == 60, "TypeLight2D layout differs from the kernels");
+
+struct QualityLevel {
+    int nLightAngles;
+    int shadowMapScale;
+    int softSize;
+    bool upsample;
+};
+
+// from cheapest to most expensive, level 3 is the default configuration
+const QualityLevel kQualityLevels[] = {
+    {  128, 8, 0, true  },
+    {  256, 8, 1, true  },
+    {  256, 4, 1, false },
+    {  512, 4, 2, false },
+    { 1024, 4, 2, false },
+    { 1024, 2, 3, false },
+    { 2048, 2, 3, false },
+};
+const int kNumQualityLevels = sizeof(kQualityLevels)/sizeof(kQualityLevels[0]);
+
+// consecutive frames outside of the target band before switching a level
+constexpr int kSlowFramesToSwitch = 10;
+constexpr int kFastFramesToSwitch = 60;
+
+// temporal mode - bin rotations cycled through on consecutive row refreshes
+const float kBinJitter[] = { 0.0f, 0.5f, 0.25f, 0.75f };
+constexpr int kJitterPhases = sizeof(kBinJitter)/sizeof(kBinJitter[0]);
+
+// frames the shadow map keeps being shaded after a change, so both checkerboard halves
+// and the history converge
+constexpr int kTemporalFrames = 8;
+
+// the row kernel is tuned on a grid of square occluders of this size and spacing in cells.
+// the results are stored under the name of the pattern, so changing it re-tunes
+constexpr int kTuneOccluderSize = 8;
+constexpr int kTuneOccluderSpacing = 32;
+const char * const kTuneWorkload = "occluders-8-32";
+}
+
 struct Geometry::Data {
     Data() {
         _objects = std::make_shared<::Data::Objects>();
         _lights = std::make_shared<::Data::Lights>();
         _lightDistance = std::make_shared<::Data::LightDistance>();
+        _stamps = std::make_shared<::Data::Stamps>();
+        _spriteMasks = std::make_shared<::Data::SpriteMasks>();
+        _spriteMaskData = std::make_shared<::Data::SpriteMaskData>();
+        _spriteInstances = std::make_shared<::Data::SpriteInstances>();
+        _segments = std::make_shared<::Data::Segments>();
+        _lightIds = std::make_shared<::Data::LightIds>();
+        _lightWedges = std::make_shared<::Data::LightWedges>();
+        _lightAnims = std::make_shared<::Data::LightAnims>();
+        _lightKeys = std::make_shared<::Data::LightKeys>();
+        _lightRefresh = std::make_shared<::Data::LightRefreshes>();
+    }
+
+    void addStamp(const CLIF::TypeStamp & stamp, int xmin, int ymin, int xmax, int ymax, int sizeX, int sizeY) {
+        xmin = std::max(xmin, 0); xmax = std::min(xmax, sizeX - 1);
+        ymin = std::max(ymin, 0); ymax = std::min(ymax, sizeY - 1);
+        if (xmin > xmax || ymin > ymax) return;
+
+        if (_stamps->empty()) {
+            _stampsX0 = xmin; _stampsX1 = xmax;
+            _stampsY0 = ymin; _stampsY1 = ymax;
+        } else {
+            _stampsX0 = std::min(_stampsX0, xmin); _stampsX1 = std::max(_stampsX1, xmax);
+            _stampsY0 = std::min(_stampsY0, ymin); _stampsY1 = std::max(_stampsY1, ymax);
+        }
+
+        _stamps->push_back(stamp);
     }
 
     std::shared_ptr<::Data::Objects>        _objects;
     std::shared_ptr<::Data::Lights>         _lights;
     std::shared_ptr<::Data::LightDistance>  _lightDistance;
+    std::shared_ptr<::Data::Stamps>         _stamps;
+
+    std::shared_ptr<::Data::SpriteMasks>     _spriteMasks;
+    std::shared_ptr<::Data::SpriteMaskData>  _spriteMaskData;
+    std::shared_ptr<::Data::SpriteInstances> _spriteInstances;
+
+    std::shared_ptr<::Data::Segments> _segments;
+    std::shared_ptr<::Data::LightIds> _lightIds;
+    std::shared_ptr<::Data::LightWedges> _lightWedges;
+
+    // the host copy of the objects is out of date after device-side stamping
+    bool _objectsOnHost = true;
+    int _objectsCapacity = 0;
+
+    int _stampsCapacity = 0;
+    int _stampsX0 = 0;
+    int _stampsY0 = 0;
+    int _stampsX1 = -1;
+    int _stampsY1 = -1;
+
+    // static objects + sprite instances, used by the lighting when sprites are present
+    bool _useObjectsFrame = false;
+    bool _spriteMasksChanged = false;
+    int _objectsFrameSize = 0;
+    int _spriteInstancesCapacity = 0;
+
+    bool _segmentsChanged = false;
+    int _segmentsCapacity = 0;
+
+    static bool hasLightChanged(const CLIF::TypeLight2D & a, const CLIF::TypeLight2D & b) {
+        return a.x0 != b.x0 || a.y0 != b.y0 ||
+            a.size != b.size || a.falloff != b.falloff || a.intensity != b.intensity ||
+            a.dir.s[0] != b.dir.s[0] || a.dir.s[1] != b.dir.s[1] || a.ang != b.ang;
+    }
+
+    // lights as they were when their distance rows were last computed - this is what the
+    // device sees, so lights that are not refreshed stay consistent with their rows
+    ::Data::Lights _lightsPrev;
+
+    // row lengths the lightDistance buffers are laid out for. the rows are packed back to back,
+    // a row that had to grow since is moved to the end and leaves its old space unused
+    std::vector<int> _lightBins;
+    int _lightDistanceSize = 0;
+    int _lightDistanceCapacity = 0;
+    bool _lightBinsChanged = false;
+
+    std::vector<cl_int> _dirtyLights;
+
+    // the animations and keys are uploaded on edits only, the device applies them to the
+    // refreshed lights. _lightsDevice is what the lights buffer holds apart from the positions
+    std::shared_ptr<::Data::LightAnims> _lightAnims;
+    std::shared_ptr<::Data::LightKeys> _lightKeys;
+    std::shared_ptr<::Data::LightRefreshes> _lightRefresh;
+    std::vector<std::vector<CLIF::TypeLightKey>> _lightKeyLists;
+    ::Data::Lights _lightsDevice;
+    bool _lightAnimsChanged = false;
+    std::vector<int> _lightUploads;
+    int _lightKeysCapacity = 0;
+    float _animTime = 0.0f;
+
+    // same as bounce() and evalLightAnim() in the kernels
+    static float bounce(float p) {
+        float q = p + 1.0f;
+        q -= 4.0f*std::floor(0.25f*q);
+        return (q < 2.0f) ? q - 1.0f : 3.0f - q;
+    }
+
+    void evalLightAnim(const CLIF::TypeLightAnim & anim, float time, float & x, float & y) const {
+        if (anim.type == LIGHT_ANIM_PATH) {
+            x = anim.pathX.s[0] + anim.pathX.s[1]*std::sin(anim.pathX.s[2]*time + anim.pathX.s[3]);
+            y = anim.pathY.s[0] + anim.pathY.s[1]*std::sin(anim.pathY.s[2]*time + anim.pathY.s[3]);
+            return;
+        }
+
+        if (anim.type == LIGHT_ANIM_VELOCITY) {
+            float dt = time - anim.t0;
+            x = bounce(anim.origin.s[0] + anim.velocity.s[0]*dt);
+            y = bounce(anim.origin.s[1] + anim.velocity.s[1]*dt);
+            return;
+        }
+
+        const auto * k = _lightKeys->data() + anim.keyStart;
+        const int n = anim.nKeys;
+
+        float t = time - anim.t0;
+        t -= anim.period*std::floor(t/anim.period);
+
+        int i = -1;
+        while (i + 1 < n && k[i + 1].t <= t) ++i;
+
+        int ia = (i < 0) ? n - 1 : i;
+        int ib = (i + 1 < n) ? i + 1 : 0;
+        float ta = (i < 0) ? k[ia].t - anim.period : k[ia].t;
+        float tb = (i + 1 < n) ? k[ib].t : k[ib].t + anim.period;
+
+        float u = (tb > ta) ? (t - ta)/(tb - ta) : 0.0f;
+        x = k[ia].x + u*(k[ib].x - k[ia].x);
+        y = k[ia].y + u*(k[ib].y - k[ia].y);
+    }
+
+    // the fields of a light that the refresh records do not carry
+    static bool hasLightFieldsChanged(const CLIF::TypeLight2D & a, const CLIF::TypeLight2D & b) {
+        return a.size != b.size || a.falloff != b.falloff || a.intensity != b.intensity ||
+            a.dir.s[0] != b.dir.s[0] || a.dir.s[1] != b.dir.s[1] || a.ang != b.ang ||
+            a.active != b.active || a.binOffset != b.binOffset || a.nBins != b.nBins ||
+            std::memcmp(&a.color, &b.color, sizeof(a.color)) != 0;
+    }
+
+    void rebuildLightKeys() {
+        _lightKeys->clear();
+        for (int l = 0; l < (int) _lightKeyLists.size(); ++l) {
+            (*_lightAnims)[l].keyStart = _lightKeys->size();
+            _lightKeys->insert(_lightKeys->end(), _lightKeyLists[l].begin(), _lightKeyLists[l].end());
+        }
+        _lightAnimsChanged = true;
+    }
+
+    // frames since the row of each light was refreshed, -1 if it was never computed
+    std::vector<int> _lightAge;
+
+    // temporal mode state
+    std::vector<int> _lightPhase;
+    std::vector<int> _lightPhasesLeft;
+    ::Data::Lights _lightsShaded;
+    std::vector<cl_float> _lightMotion;
+    bool _temporalPrev = false;
+    bool _upsamplePrev = false;
+    bool _historyValid = false;
+    int _temporalFramesLeft = 0;
+    int _frame = 0;
+
+    // the last calcShadowMap2 arguments, the refinement of the upsampling shades the same way
+    CLIF::TypeShadeParams _shadeParams;
+
+    // kernels and buffers of the per-frame passes, resolved once in configure
+    struct KernelHandles {
+        OCL::BaseManager::KernelHandle resetLightDistance;
+        OCL::BaseManager::KernelHandle calcDistance2;
+        OCL::BaseManager::KernelHandle resetLightDistanceWedges;
+        OCL::BaseManager::KernelHandle calcDistanceWedges;
+        OCL::BaseManager::KernelHandle calcDistanceSegments;
+        OCL::BaseManager::KernelHandle copyLightDistance;
+        OCL::BaseManager::KernelHandle accumulateShadow;
+        OCL::BaseManager::KernelHandle calcShadowMap2;
+        OCL::BaseManager::KernelHandle upsampleShadow;
+        OCL::BaseManager::KernelHandle animateLights;
+    } _kernels;
+
+    struct BufferHandles {
+        OCL::BaseManager::BufferHandle objects;
+        OCL::BaseManager::BufferHandle objectsFrame;
+        OCL::BaseManager::BufferHandle lights;
+        OCL::BaseManager::BufferHandle lightDistance;
+        OCL::BaseManager::BufferHandle lightDistanceStatic;
+        OCL::BaseManager::BufferHandle lightIds;
+        OCL::BaseManager::BufferHandle lightWedges;
+        OCL::BaseManager::BufferHandle shadeLightIds;
+        OCL::BaseManager::BufferHandle segments;
+        OCL::BaseManager::BufferHandle shadowStatic;
+        OCL::BaseManager::BufferHandle shadowHistory;
+        OCL::BaseManager::BufferHandle lightMotion;
+        OCL::BaseManager::BufferHandle lightAnims;
+        OCL::BaseManager::BufferHandle lightKeys;
+        OCL::BaseManager::BufferHandle lightRefresh;
+        OCL::BaseManager::BufferHandle texShadowmap;
+        OCL::BaseManager::BufferHandle texShadowfull;
+    } _buffers;
+
+    // running estimate of the device time needed to recompute one full row, from the rows
+    // counted in the last frame
+    int _rowsLast = 0;
+    float _rowCost = 0.0f;
+
+    // the shadow map has to be re-shaded as a whole, e.g. after a resize
+    bool _forceShade = false;
+
+    // grid cells visible in the view
+    Rect _viewRect;
+
+    // frame-time controller state, set if the last frame shaded the map
+    bool _frameTimed = false;
+    float _frameTime = 0.0f;
+    int _qualityLevel = -1;
+    int _nSlowFrames = 0;
+    int _nFastFrames = 0;
+
+    // picks the dirty lights to refresh this frame - the most visible motion, the brightest and
+    // the longest waiting first. lights that were never computed are always refreshed. lights
+    // that do not reach the view are left pending
+    std::vector<cl_int> scheduleLights(int budget, int sizeX, bool temporal, const std::vector<bool> & isInView) {
+        const auto & lights = *_lights;
+
+        std::vector<std::pair<float, cl_int>> order;
+        std::vector<cl_int> res;
+        for (auto l : _dirtyLights) {
+            if (isInView[l] == false) continue;
+            if (_lightAge[l] < 0) { res.push_back(l); continue; }
+
+            float dx = lights[l].x0 - _lightsPrev[l].x0;
+            float dy = lights[l].y0 - _lightsPrev[l].y0;
+            float motion = 0.5f*std::sqrt(dx*dx + dy*dy)*sizeX;
+
+            order.emplace_back(-lights[l].intensity*(1.0f + motion)*(1.0f + _lightAge[l]), l);
+        }
+
+        std::sort(order.begin(), order.end());
+        for (int i = 0; i < (int) order.size() && (int) res.size() < budget; ++i) {
+            res.push_back(order[i].second);
+        }
+
+        for (auto & age : _lightAge) if (age >= 0) ++age;
+        for (auto l : res) {
+            bool isMoved = _lightAge[l] < 0 || hasLightChanged(lights[l], _lightsPrev[l]);
+
+            _lightsPrev[l] = lights[l];
+            _lightAge[l] = 0;
+
+            // in temporal mode every refresh rotates the bins by the next jitter offset and a
+            // light that stopped is refreshed at the remaining offsets, so the history converges
+            _lightsPrev[l].binShift = temporal ? kBinJitter[_lightPhase[l]++ % kJitterPhases] : 0.0f;
+            if (temporal == false) {
+                _lightPhasesLeft[l] = 0;
+            } else if (isMoved) {
+                _lightPhasesLeft[l] = kJitterPhases - 1;
+            } else {
+                _lightPhasesLeft[l] = std::max(_lightPhasesLeft[l] - 1, 0);
+            }
+        }
+
+        return res;
+    }
+
+    // bumped on every change of the occupancy seen by the lights
+    int _objectsGeneration = 0;
+    int _objectsGenerationUsed = -1;
+
+    // cells changed since the distance rows were last updated
+    Rect _objectsDirty;
+    Rect _spritesRect;
+
+    // the occluder edge test of a cell reads its neighbours, so they change along with it
+    void markObjectsChanged(const Rect & r, int sizeX, int sizeY) {
+        _objectsGeneration++;
+        _objectsDirty.add(r.grow(1, sizeX, sizeY));
+    }
+
+    void markObjectsChanged(int sizeX, int sizeY) {
+        markObjectsChanged(Rect::make(0, 0, sizeX - 1, sizeY - 1), sizeX, sizeY);
+    }
+
+    // static lights keep their rows against the static occupancy (objects + segments) in
+    // lightDistanceStatic. the sprites are the dynamic occupancy - static lights within their
+    // reach get the cached row min-merged with the sprite cells, the others are summed once
+    // into shadowStatic
+    std::vector<bool> _lightIsStatic;
+    std::vector<bool> _lightIsAffected;
+    bool _shadowStaticValid = false;
+
+    // sprite cells changed since the rows of the dynamic lights were last updated
+    bool _spritesChanged = false;
+    Rect _spritesDirty;
+
+    bool hasStaticLights() const {
+        return std::find(_lightIsStatic.begin(), _lightIsStatic.end(), true) != _lightIsStatic.end();
+    }
+
+    // squared distance beyond which the contribution of the light is below the shading cutoff
+    static float influenceRadius2(const CLIF::TypeLight2D & light) {
+        return std::pow(100.0f*light.intensity, 0.5f*light.falloff) - 1.0f;
+    }
+
+    // same threshold as isConeLight() in the kernels
+    static bool isConeLight(const CLIF::TypeLight2D & light) {
+        return light.ang < 6.28f;
+    }
+
+    // the shortest power of two row with bins no wider than a cell at the edge of the light's
+    // influence, a cone only needs its share of the circle
+    static constexpr int kMinLightBins = 32;
+    static int lightBins(const CLIF::TypeLight2D & light, int sizeX, int nLightAngles) {
+        float n = M_PI*std::sqrt(std::max(influenceRadius2(light), 0.0f))*sizeX;
+        if (isConeLight(light)) n *= 0.5f*light.ang/M_PI;
+
+        int res = kMinLightBins;
+        while (res < n && res < nLightAngles) res *= 2;
+        return std::min(res, nLightAngles);
+    }
+
+    // angle of (dx, dy) relative to the cone axis, in units of pi
+    static float coneAngle(const CLIF::TypeLight2D & light, float dx, float dy) {
+        return std::atan2(light.dir.s[0]*dy - light.dir.s[1]*dx, light.dir.s[0]*dx + light.dir.s[1]*dy)/M_PI;
+    }
+
+    static bool isInfluenced(const CLIF::TypeLight2D & light, const Rect & rect, int sizeX, int sizeY) {
+        if (rect.empty()) return false;
+
+        float fx0 = 2.0f*rect.x0/sizeX - 1.0f;
+        float fy0 = 2.0f*rect.y0/sizeY - 1.0f;
+        float fx1 = 2.0f*(rect.x1 + 1)/sizeX - 1.0f;
+        float fy1 = 2.0f*(rect.y1 + 1)/sizeY - 1.0f;
+
+        float dx = std::max(std::max(fx0 - light.x0, light.x0 - fx1), 0.0f);
+        float dy = std::max(std::max(fy0 - light.y0, light.y0 - fy1), 0.0f);
+
+        if (dx*dx + dy*dy >= influenceRadius2(light)) return false;
+        if (isConeLight(light) == false || (dx == 0.0f && dy == 0.0f)) return true;
+
+        // the rect is seen under less than pi, a wider span of its corners goes around the back of the light
+        const float cx[4] = { fx0, fx1, fx0, fx1 };
+        const float cy[4] = { fy0, fy0, fy1, fy1 };
+
+        float h = 0.5f*light.ang/M_PI;
+        float rmin = 1.0f;
+        float rmax = -1.0f;
+        for (int i = 0; i < 4; ++i) {
+            float rel = coneAngle(light, cx[i] - light.x0, cy[i] - light.y0);
+            rmin = std::min(rmin, rel);
+            rmax = std::max(rmax, rel);
+        }
+
+        if (rmax - rmin > 1.0f) return rmax < h || rmin > -h;
+        return rmin < h && rmax > -h;
+    }
+
+    // the light's bins that the rect projects onto, padded with kWedgeMarginBins on each side,
+    // and the bounding box of all cells that project onto these bins
+    // returns false if the light sees the rect from too wide an angle - then the full row is cheaper
+    static constexpr int kWedgeMarginBins = 3;
+    bool getLightWedge(
+            const CLIF::TypeLight2D & light,
+            const Rect & rect,
+            int sizeX, int sizeY,
+            CLIF::TypeLightWedge & wedge) const {
+        // cone rows are not periodic, and their cells outside of the cone are rejected early anyway
+        if (isConeLight(light)) return false;
+
+        const int nLightAngles = light.nBins;
+
+        float fx0 = 2.0f*rect.x0/sizeX - 1.0f;
+        float fy0 = 2.0f*rect.y0/sizeY - 1.0f;
+        float fx1 = 2.0f*(rect.x1 + 1)/sizeX - 1.0f;
+        float fy1 = 2.0f*(rect.y1 + 1)/sizeY - 1.0f;
+
+        float mx = 2.0f/sizeX;
+        float my = 2.0f/sizeY;
+        if (light.x0 > fx0 - mx && light.x0 < fx1 + mx &&
+            light.y0 > fy0 - my && light.y0 < fy1 + my) return false;
+
+        const float cx[4] = { fx0, fx1, fx0, fx1 };
+        const float cy[4] = { fy0, fy0, fy1, fy1 };
+
+        int bmin = nLightAngles;
+        int bmax = 0;
+        for (int i = 0; i < 4; ++i) {
+            int iang = 0.5f*(atan2(cy[i] - light.y0, cx[i] - light.x0)/M_PI + 1.0f)*nLightAngles + light.binShift;
+            if (iang >= nLightAngles) iang -= nLightAngles;
+            bmin = std::min(bmin, iang);
+            bmax = std::max(bmax, iang);
+        }
+
+        int start = bmin;
+        int cnt = bmax - bmin;
+        if (cnt > nLightAngles/2) { cnt = bmin + nLightAngles - bmax; start = bmax; }
+        if (cnt + 2*kWedgeMarginBins >= nLightAngles/4) return false;
+
+        start -= kWedgeMarginBins;
+        if (start < 0) start += nLightAngles;
+        cnt += 2*kWedgeMarginBins + 1;
+
+        // the wedge is narrow, so its part inside the grid is covered by the triangle
+        // formed by the light and two far away points on its edges
+        const float kFar = 8.0f;
+        float bx0 = light.x0, bx1 = light.x0;
+        float by0 = light.y0, by1 = light.y0;
+        for (int b : { start, start + cnt }) {
+            float ang = M_PI*(2.0f*(b - light.binShift)/nLightAngles - 1.0f);
+            float px = light.x0 + kFar*cos(ang);
+            float py = light.y0 + kFar*sin(ang);
+            bx0 = std::min(bx0, px); bx1 = std::max(bx1, px);
+            by0 = std::min(by0, py); by1 = std::max(by1, py);
+        }
+
+        wedge.light = 0;
+        wedge.binStart = start;
+        wedge.binCount = cnt;
+        wedge.x0 = std::max((int) std::floor(0.5f*(bx0 + 1.0f)*sizeX), 0);
+        wedge.y0 = std::max((int) std::floor(0.5f*(by0 + 1.0f)*sizeY), 0);
+        wedge.x1 = std::min((int) std::floor(0.5f*(bx1 + 1.0f)*sizeX), sizeX - 1);
+        wedge.y1 = std::min((int) std::floor(0.5f*(by1 + 1.0f)*sizeY), sizeY - 1);
+
+        return true;
+    }
+
+    // candidates get a wedge for the changed rect where possible, the rest a full row in lightIds
+    Rect selectLightWedges(
+            const std::vector<cl_int> & candidates,
+            const Rect & changed,
+            int sizeX, int sizeY) {
+        auto & lightIds = *_lightIds;
+        auto & wedges = *_lightWedges;
+
+        Rect wedgesRect;
+        for (auto l : candidates) {
+            if (isInfluenced(_lightsPrev[l], changed, sizeX, sizeY) == false) continue;
+
+            CLIF::TypeLightWedge wedge;
+            if (getLightWedge(_lightsPrev[l], changed, sizeX, sizeY, wedge)) {
+                wedge.light = l;
+                wedges.push_back(wedge);
+                wedgesRect.add(Rect::make(wedge.x0, wedge.y0, wedge.x1, wedge.y1));
+            } else {
+                lightIds.push_back(l);
+            }
+        }
+
+        // the wedges cover most of the grid anyway
+        if (2*wedgesRect.area() > sizeX*sizeY) {
+            for (const auto & wedge : wedges) lightIds.push_back(wedge.light);
+            wedges.clear();
+            wedgesRect = Rect();
+        }
+
+        return wedgesRect;
+    }
 };
 
 Geometry::Geometry() {
@@ -61,41 +599,226 @@ Geometry::~Geometry() {
 
 void Geometry::configure(const std::string & fname) {
     _oclm->configure(fname);
+
+    auto & kernels = _data->_kernels;
+    kernels.resetLightDistance = _oclm->getKernelHandle("resetLightDistance");
+    kernels.calcDistance2 = _oclm->getKernelHandle("calcDistance2");
+    kernels.resetLightDistanceWedges = _oclm->getKernelHandle("resetLightDistanceWedges");
+    kernels.calcDistanceWedges = _oclm->getKernelHandle("calcDistanceWedges");
+    kernels.calcDistanceSegments = _oclm->getKernelHandle("calcDistanceSegments");
+    kernels.copyLightDistance = _oclm->getKernelHandle("copyLightDistance");
+    kernels.accumulateShadow = _oclm->getKernelHandle("accumulateShadow");
+    kernels.calcShadowMap2 = _oclm->getKernelHandle("calcShadowMap2");
+    kernels.upsampleShadow = _oclm->getKernelHandle("upsampleShadow");
+    kernels.animateLights = _oclm->getKernelHandle("animateLights");
+
+    // the handles stay valid when the buffers are (re)allocated later
+    auto & buffers = _data->_buffers;
+    buffers.objects = _oclm->getBufferHandle("objects");
+    buffers.objectsFrame = _oclm->getBufferHandle("objectsFrame");
+    buffers.lights = _oclm->getBufferHandle("lights");
+    buffers.lightDistance = _oclm->getBufferHandle("lightDistance");
+    buffers.lightDistanceStatic = _oclm->getBufferHandle("lightDistanceStatic");
+    buffers.lightIds = _oclm->getBufferHandle("lightIds");
+    buffers.lightWedges = _oclm->getBufferHandle("lightWedges");
+    buffers.shadeLightIds = _oclm->getBufferHandle("shadeLightIds");
+    buffers.segments = _oclm->getBufferHandle("segments");
+    buffers.shadowStatic = _oclm->getBufferHandle("shadowStatic");
+    buffers.shadowHistory = _oclm->getBufferHandle("shadowHistory");
+    buffers.lightMotion = _oclm->getBufferHandle("lightMotion");
+    buffers.lightAnims = _oclm->getBufferHandle("lightAnims");
+    buffers.lightKeys = _oclm->getBufferHandle("lightKeys");
+    buffers.lightRefresh = _oclm->getBufferHandle("lightRefresh");
+    buffers.texShadowmap = _oclm->getBufferHandle("tex_shadowmap");
+    buffers.texShadowfull = _oclm->getBufferHandle("tex_shadowfull");
 }
 
 void Geometry::allocate(int sizeX, int sizeY) {
+    if (_sizeX > 0) syncObjects();
+    _data->_stamps->clear();
+    _data->_useObjectsFrame = false;
+    _data->_objectsFrameSize = 0;
+
     _sizeX = sizeX;
     _sizeY = sizeY;
 
     _data->_objects->resize(_sizeX*_sizeY, 0.0f);
+    _data->_objectsCapacity = _sizeX*_sizeY;
 
     _oclm->allocateOpenCLBuffer("objects",
-            (OCL::BaseManager::CLFlags) (OCL::BaseManager::CLFlags::MEM_READ_WRITE | OCL::BaseManager::CLFlags::MEM_COPY_HOST_PTR),
+            (OCL::BaseManager::CLFlags) (OCL::BaseManager::CLFlags::MEM_READ_WRITE | OCL::BaseManager::CLFlags::MEM_COPY_HOST_PTR |
+                                         OCL::BaseManager::CLFlags::MEM_HOST_VISIBLE),
             _sizeX*sizeY*sizeof(CLIF::TypeObject), _data->_objects->data());
 
-    _data->_lights->resize(_nLights);
-    for (int l = 0; l < _nLights; ++l) {
-        _data->_lights->at(l).color = { {1.0f, 1.0f, 1.0f, 1.0f} };
-        _data->_lights->at(l).dir = { {1.0, 0.0} };
-        _data->_lights->at(l).x0 = 0.0;
-        _data->_lights->at(l).y0 = 0.0;
-        _data->_lights->at(l).size = (rand()%200)*0.0001 + 0.001;
-        _data->_lights->at(l).falloff = 0.3;
-        _data->_lights->at(l).ang = 2.0*M_PI;
-        _data->_lights->at(l).intensity = 0.25;
-        _data->_lights->at(l).active = true;
+    allocateLights();
+
+    _viewX0 = -1.0f; _viewY0 = -1.0f;
+    _viewX1 =  1.0f; _viewY1 =  1.0f;
+    updateViewRect();
+    _data->_spritesChanged = false;
+    _data->_spritesDirty = Rect();
+    _data->markObjectsChanged(_sizeX, _sizeY);
+
+    allocateLightDistance();
+    allocateGridTextures();
+    allocateShadowMap();
+}
+
+void Geometry::reconfigure(int sizeX, int sizeY, int nLights, int nLightAngles) {
+    if (_sizeX <= 0) {
+        _nLights = nLights;
+        _nLightAngles = nLightAngles;
+        allocate(sizeX, sizeY);
+        updateFloorTexture();
+        updateObjectsTexture();
+        return;
+    }
+
+    bool isResized = (sizeX != _sizeX || sizeY != _sizeY);
+    bool isLightCountChanged = (nLights != _nLights);
+    if (isResized == false && isLightCountChanged == false) {
+        setLightAngles(nLightAngles);
+        return;
+    }
+
+    if (isResized) {
+        resampleObjects(sizeX, sizeY);
+        updateViewRect();
+        allocateGridTextures();
+        allocateShadowMap();
+
+        // the new textures are empty - the occupancy is already on the device and marked dirty
+        updateFloorTexture();
+        drawObjectsTexture();
+    }
+
+    if (isLightCountChanged) {
+        _nLights = nLights;
+        allocateLights();
+    }
+
+    // the rows depend on both the grid size and the light count
+    _nLightAngles = nLightAngles;
+    allocateLightDistance();
+
+    // the old sizes are unlikely to be allocated again
+    _oclm->releaseBufferPool();
+}
+
+// existing lights and their animations are kept, new ones get the defaults
+void Geometry::allocateLights() {
+    auto & lights = *_data->_lights;
+    auto & anims = *_data->_lightAnims;
+
+    int nOld = std::min((int) lights.size(), _nLights);
+    lights.resize(_nLights);
+    for (int l = nOld; l < _nLights; ++l) {
+        lights[l].color = { {1.0f, 1.0f, 1.0f, 1.0f} };
+        lights[l].dir = { {1.0, 0.0} };
+        lights[l].x0 = 0.0;
+        lights[l].y0 = 0.0;
+        lights[l].size = (rand()%200)*0.0001 + 0.001;
+        lights[l].falloff = 0.3;
+        lights[l].ang = 2.0*M_PI;
+        lights[l].intensity = 0.25;
+        lights[l].active = 1;
+        lights[l].binShift = 0.0f;
     }
 
     _oclm->allocateOpenCLBuffer("lights",
-            (OCL::BaseManager::CLFlags) (OCL::BaseManager::CLFlags::MEM_READ_WRITE | OCL::BaseManager::CLFlags::MEM_COPY_HOST_PTR),
-            _nLights*sizeof(CLIF::TypeLight2D), _data->_lights->data());
+            (OCL::BaseManager::CLFlags) (OCL::BaseManager::CLFlags::MEM_READ_WRITE | OCL::BaseManager::CLFlags::MEM_COPY_HOST_PTR |
+                                         OCL::BaseManager::CLFlags::MEM_HOST_VISIBLE),
+            _nLights*sizeof(CLIF::TypeLight2D), lights.data());
 
-    _data->_lightDistance->resize(_nLights*_nLightAngles, 0.0f);
+    anims.resize(_nLights, CLIF::TypeLightAnim());
+    _data->_lightKeyLists.resize(_nLights);
+    for (int l = nOld; l < _nLights; ++l) {
+        float w = l + 1;
+        setLightPath(l, 0.0f, 0.5f, w, w, 0.0f, 0.8f, 0.5f*w, w + 0.5f*M_PI);
+    }
+    _data->_lightKeysCapacity = 0;
+    _data->rebuildLightKeys();
+
+    _oclm->allocateOpenCLBuffer("lightAnims",
+            (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ,
+            std::max(_nLights, 1)*sizeof(CLIF::TypeLightAnim), NULL);
+
+    _oclm->allocateOpenCLBuffer("lightRefresh",
+            (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ,
+            std::max(_nLights, 1)*sizeof(CLIF::TypeLightRefresh), NULL);
+
+    _data->_lightsDevice = lights;
+    _data->_lightsPrev.clear();
+    _data->_lightIsStatic.resize(_nLights, false);
+    _data->_lightIsAffected.assign(_nLights, false);
+    _data->_lightPhase.assign(_nLights, 0);
+    _data->_lightPhasesLeft.assign(_nLights, 0);
+    _data->_lightsShaded.clear();
+    _data->_lightMotion.assign(_nLights, 0.0f);
+    _data->_shadowStaticValid = false;
 
-    _oclm->allocateOpenCLBuffer("lightDistance",
-            (OCL::BaseManager::CLFlags) (OCL::BaseManager::CLFlags::MEM_READ_WRITE | OCL::BaseManager::CLFlags::MEM_COPY_HOST_PTR),
-            _nLights*_nLightAngles*sizeof(cl_float), _data->_lightDistance->data());
+    _oclm->allocateOpenCLBuffer("lightIds",
+            (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ,
+            std::max(_nLights, 1)*sizeof(cl_int), NULL);
+
+    _oclm->allocateOpenCLBuffer("lightWedges",
+            (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ,
+            std::max(_nLights, 1)*sizeof(CLIF::TypeLightWedge), NULL);
+
+    _oclm->allocateOpenCLBuffer("lightMotion",
+            (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ,
+            std::max(_nLights, 1)*sizeof(cl_float), NULL);
+
+    _oclm->allocateOpenCLBuffer("shadeLightIds",
+            (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ,
+            std::max(_nLights, 1)*sizeof(cl_int), NULL);
+}
 
+// the occupancy is resampled on the device - a cell takes the max of the cells it covers, so
+// thin occluders survive shrinking. the buffers are reused when they are large enough
+void Geometry::resampleObjects(int sizeX, int sizeY) {
+    // pending stamps are in cells of the old grid
+    applyStamps();
+
+    const int n = sizeX*sizeY;
+    if (_data->_objectsFrameSize < n) {
+        _data->_objectsFrameSize = n;
+        _oclm->allocateOpenCLBuffer("objectsFrame",
+                (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ_WRITE,
+                n*sizeof(CLIF::TypeObject), NULL);
+    }
+
+    cl_uint srcX = _sizeX;
+    cl_uint srcY = _sizeY;
+
+    _oclm->setKernelArgAsBuffer("resampleObjects", 0, "objectsFrame");
+    _oclm->setKernelArgAsBuffer("resampleObjects", 1, "objects");
+    _oclm->setKernelArg("resampleObjects", 2, sizeof(cl_uint), &srcX);
+    _oclm->setKernelArg("resampleObjects", 3, sizeof(cl_uint), &srcY);
+    int wgs = (sizeX % 8 == 0 && sizeY % 8 == 0) ? 8 : 0;
+    _oclm->runKernel2D("resampleObjects", sizeX, sizeY, wgs, wgs);
+
+    if (_data->_objectsCapacity < n) {
+        _data->_objectsCapacity = n;
+        _oclm->allocateOpenCLBuffer("objects",
+                (OCL::BaseManager::CLFlags) (OCL::BaseManager::CLFlags::MEM_READ_WRITE | OCL::BaseManager::CLFlags::MEM_HOST_VISIBLE),
+                n*sizeof(CLIF::TypeObject), NULL);
+    }
+    _oclm->copyBuffer("objectsFrame", "objects", n*sizeof(CLIF::TypeObject));
+
+    _sizeX = sizeX;
+    _sizeY = sizeY;
+
+    // the host copy is read back on the next syncObjects
+    _data->_objects->resize(n);
+    _data->_objectsOnHost = false;
+    _data->_useObjectsFrame = false;
+    _data->_spritesChanged = false;
+    _data->_spritesDirty = Rect();
+    _data->markObjectsChanged(_sizeX, _sizeY);
+}
+
+void Geometry::allocateGridTextures() {
     {
         Texture2D &t = _textures["tex_floor"];
         if (t.glid) { glDeleteTextures(1, &t.glid); t.glid = 0; }
@@ -129,9 +852,9 @@ void Geometry::allocate(int sizeX, int sizeY) {
     }
 
     {
-        Texture2D &t = _textures["tex_shadowmap"];
+        Texture2D &t = _textures["tex_shadowfull"];
         if (t.glid) { glDeleteTextures(1, &t.glid); t.glid = 0; }
-        t.setDimensions(_sizeX/4, _sizeY/4);
+        t.setDimensions(_sizeX, _sizeY);
 
         glGenTextures(1, &t.glid);
         glBindTexture(GL_TEXTURE_2D, t.glid);
@@ -139,12 +862,83 @@ void Geometry::allocate(int sizeX, int sizeY) {
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, t._sizeX, t._sizeY, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, _sizeX, _sizeY, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
 
-        _oclm->allocateOpenCLTexture2D("tex_shadowmap", (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_WRITE, t.glid);
+        _oclm->allocateOpenCLTexture2D("tex_shadowfull", (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_WRITE, t.glid);
     }
 }
 
+void Geometry::allocateLightDistance() {
+    auto & lights = *_data->_lights;
+    auto & lightsPrev = _data->_lightsPrev;
+    auto & bins = _data->_lightBins;
+
+    bins.resize(_nLights);
+    int nTotal = 0;
+    for (int l = 0; l < _nLights; ++l) {
+        bins[l] = Data::lightBins(lights[l], _sizeX, _nLightAngles);
+        lights[l].binOffset = nTotal;
+        lights[l].nBins = bins[l];
+        if (l < (int) lightsPrev.size()) {
+            lightsPrev[l].binOffset = lights[l].binOffset;
+            lightsPrev[l].nBins = lights[l].nBins;
+        }
+        nTotal += bins[l];
+    }
+    _data->_lightDistanceSize = nTotal;
+    _data->_lightBinsChanged = true;
+
+    // the rows are reset before they are computed, so a large enough buffer is reused as is.
+    // the spare half takes the rows that grow later
+    if (nTotal > _data->_lightDistanceCapacity) {
+        const int capacity = nTotal + nTotal/2;
+        _data->_lightDistanceCapacity = capacity;
+        _data->_lightDistance->assign(capacity, 0.0f);
+
+        _oclm->allocateOpenCLBuffer("lightDistance",
+                (OCL::BaseManager::CLFlags) (OCL::BaseManager::CLFlags::MEM_READ_WRITE | OCL::BaseManager::CLFlags::MEM_COPY_HOST_PTR),
+                capacity*sizeof(cl_float), _data->_lightDistance->data());
+
+        _oclm->allocateOpenCLBuffer("lightDistanceStatic",
+                (OCL::BaseManager::CLFlags) (OCL::BaseManager::CLFlags::MEM_READ_WRITE | OCL::BaseManager::CLFlags::MEM_COPY_HOST_PTR),
+                capacity*sizeof(cl_float), _data->_lightDistance->data());
+    }
+
+    // every row has to be recomputed from scratch
+    _data->_lightAge.assign(_nLights, -1);
+    _data->_dirtyLights.clear();
+    for (int l = 0; l < _nLights; ++l) _data->_dirtyLights.push_back(l);
+    _data->_shadowStaticValid = false;
+}
+
+void Geometry::allocateShadowMap() {
+    Texture2D &t = _textures["tex_shadowmap"];
+    if (t.glid) { glDeleteTextures(1, &t.glid); t.glid = 0; }
+    t.setDimensions(_sizeX/_shadowMapScale, _sizeY/_shadowMapScale);
+
+    glGenTextures(1, &t.glid);
+    glBindTexture(GL_TEXTURE_2D, t.glid);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, t._sizeX, t._sizeY, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+
+    _oclm->allocateOpenCLTexture2D("tex_shadowmap", (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_WRITE, t.glid);
+
+    _oclm->allocateOpenCLBuffer("shadowStatic",
+            (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ_WRITE,
+            t._sizeX*t._sizeY*sizeof(cl_float), NULL);
+
+    _oclm->allocateOpenCLBuffer("shadowHistory",
+            (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ_WRITE,
+            t._sizeX*t._sizeY*sizeof(cl_float), NULL);
+
+    _data->_shadowStaticValid = false;
+    _data->_historyValid = false;
+    _data->_forceShade = true;
+}
+
 void Geometry::updateFloorTexture() {
     _oclm->setKernelArgAsBuffer("drawFloor", 0, "tex_floor");
 
@@ -154,8 +948,22 @@ void Geometry::updateFloorTexture() {
 }
 
 void Geometry::updateObjectsTexture() {
-    _oclm->writeBuffer("objects", CL_FALSE, _sizeX*_sizeY*sizeof(CLIF::TypeObject), _data->_objects->data());
+    if (_data->_objectsOnHost) {
+        const int size = _sizeX*_sizeY*sizeof(CLIF::TypeObject);
+        if (_oclm->isHostVisible("objects")) {
+            void * ptr = _oclm->mapBuffer("objects", CL_TRUE, OCL::BaseManager::MAP_WRITE_INVALIDATE, 0, size);
+            std::memcpy(ptr, _data->_objects->data(), size);
+            _oclm->unmapBuffer("objects", ptr);
+        } else {
+            _oclm->writeBuffer("objects", CL_FALSE, size, _data->_objects->data());
+        }
+    }
+    _data->markObjectsChanged(_sizeX, _sizeY);
+
+    drawObjectsTexture();
+}
 
+void Geometry::drawObjectsTexture() {
     _oclm->setKernelArgAsBuffer("drawObjects", 0, "tex_data");
     _oclm->setKernelArgAsBuffer("drawObjects", 1, "objects");
 
@@ -165,50 +973,872 @@ void Geometry::updateObjectsTexture() {
 }
 
 void Geometry::updateLights() {
-    float t = _timer.time()*0.1;
-    for (int l = 1; l <= _nLights; ++l) {
-        _data->_lights->at(l-1).x0 = 0.5*sin(t*l + l);
-        _data->_lights->at(l-1).y0 = 0.8*cos(t*0.5*l + l);
+    // the host evaluates the animations too - the scheduler needs the positions
+    _data->_animTime = _timer.time()*0.1;
+    if (_animateLights) {
+        for (int l = 0; l < _nLights; ++l) {
+            if (_data->_lightIsStatic[l]) continue;
+
+            const auto & anim = (*_data->_lightAnims)[l];
+            if (anim.type == LIGHT_ANIM_NONE) continue;
+
+            auto & light = _data->_lights->at(l);
+            _data->evalLightAnim(anim, _data->_animTime, light.x0, light.y0);
+        }
     }
 
-    _oclm->writeBuffer("lights", CL_TRUE, _nLights*sizeof(CLIF::TypeLight2D), _data->_lights->data());
+    auto & lights = *_data->_lights;
+    auto & lightsPrev = _data->_lightsPrev;
+    auto & dirtyLights = _data->_dirtyLights;
+
+    if ((int) lightsPrev.size() != _nLights) {
+        lightsPrev.resize(_nLights);
+        _data->_lightAge.assign(_nLights, -1);
+        _data->markObjectsChanged(_sizeX, _sizeY);
+    }
+
+    // a light whose reach changed enough needs a different row length. a shorter row stays in
+    // place, a longer one moves to the end of the buffer - only these lights are recomputed.
+    // the rows are repacked when the spare space runs out
+    if ((int) _data->_lightBins.size() != _nLights) {
+        allocateLightDistance();
+    } else {
+        for (int l = 0; l < _nLights; ++l) {
+            int nBins = Data::lightBins(lights[l], _sizeX, _nLightAngles);
+            if (nBins == lights[l].nBins) continue;
+
+            if (nBins > _data->_lightBins[l]) {
+                if (_data->_lightDistanceSize + nBins > _data->_lightDistanceCapacity) {
+                    allocateLightDistance();
+                    break;
+                }
+                lights[l].binOffset = _data->_lightDistanceSize;
+                _data->_lightBins[l] = nBins;
+                _data->_lightDistanceSize += nBins;
+            }
+            lights[l].nBins = nBins;
+
+            _data->_lightAge[l] = -1;
+            if (_data->_lightIsStatic[l]) _data->_shadowStaticValid = false;
+        }
+    }
+    for (int l = 0; l < _nLights; ++l) {
+        lightsPrev[l].binOffset = lights[l].binOffset;
+        lightsPrev[l].nBins = lights[l].nBins;
+    }
+
+    // the rows are refreshed and the lights uploaded by the scheduler in calcShadowMap
+    dirtyLights.clear();
+    for (int l = 0; l < _nLights; ++l) {
+        if (_data->_lightAge[l] < 0 || Data::hasLightChanged(lights[l], lightsPrev[l]) ||
+            (_temporal && _data->_lightPhasesLeft[l] > 0)) {
+            dirtyLights.push_back(l);
+        }
+    }
 }
 
 void Geometry::calcShadowMap() {
-    _oclm->fillBufferFloat("lightDistance", 100.0f, _nLights*_nLightAngles);
-    //clFinish(_oclQueue);
+    const auto & kernels = _data->_kernels;
+    const auto & buffers = _data->_buffers;
+
+    cl_int nSegments = _data->_segments->size();
+    if (_data->_segmentsChanged) {
+        if (nSegments > _data->_segmentsCapacity) {
+            _data->_segmentsCapacity = std::max(64, 2*nSegments);
+            _oclm->allocateOpenCLBuffer("segments",
+                    (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ,
+                    _data->_segmentsCapacity*sizeof(CLIF::TypeSegment), NULL);
+        }
+        if (nSegments > 0) {
+            _oclm->writeBuffer("segments", CL_FALSE, nSegments*sizeof(CLIF::TypeSegment), _data->_segments->data());
+        }
+        _data->_segmentsChanged = false;
+    }
+
+    // adapt the row cost and the quality to the device time of the last frame before any work
+    // is scheduled. its commands have executed by now, so reading the time does not wait
+    {
+        float rowsTime = _oclm->takeTiming("calcShadowMap.rows");
+        if (_data->_rowsLast > 0 && rowsTime > 0.0f) {
+            float cost = rowsTime/_data->_rowsLast;
+            _data->_rowCost = (_data->_rowCost > 0.0f) ? 0.9f*_data->_rowCost + 0.1f*cost : cost;
+        }
+        _data->_rowsLast = 0;
+
+        float frameTime = _oclm->takeTiming("calcShadowMap") + rowsTime;
+        if (_targetFrameTime > 0.0f && _data->_frameTimed && frameTime > 0.0f) updateQuality(frameTime);
+        _data->_frameTimed = false;
+    }
+    OCL::BaseManager::TimingScope timing(*_oclm, "calcShadowMap");
+
+    const bool useStatic = _data->hasStaticLights();
+    auto & lightIds = *_data->_lightIds;
+    auto & wedges = *_data->_lightWedges;
+
+    // cells of the static occupancy changed since the last update
+    Rect changed;
+    if (_data->_objectsGeneration != _data->_objectsGenerationUsed) {
+        changed = _data->_objectsDirty;
+        _data->_objectsGenerationUsed = _data->_objectsGeneration;
+        _data->_objectsDirty = Rect();
+    }
+
+    // moved lights beyond the per-frame budget keep their previous rows and stay pending
+    int budget = (_lightRowBudget > 0) ? _lightRowBudget : _nLights;
+    if (_lightTimeBudget > 0.0f && _data->_rowCost > 0.0f) {
+        budget = std::min(budget, std::max(1, (int) (_lightTimeBudget/_data->_rowCost)));
+    }
+
+    if (_upsample != _data->_upsamplePrev) {
+        _data->_upsamplePrev = _upsample;
+        _data->_forceShade = true;
+    }
+
+    if (_temporal != _data->_temporalPrev) {
+        _data->_temporalPrev = _temporal;
+        _data->_historyValid = false;
+    }
+
+    // lights whose influence does not reach the view are neither recomputed nor shaded.
+    // if their rows miss an occupancy change they are recomputed when they come into view
+    const Rect & viewRect = _data->_viewRect;
+    std::vector<bool> isInView(_nLights, true);
+    for (int l = 0; l < _nLights; ++l) {
+        isInView[l] = Data::isInfluenced(_data->_lights->at(l), viewRect, _sizeX, _sizeY);
+    }
+
+    std::vector<bool> isDirty(_nLights, false);
+    auto scheduled = _data->scheduleLights(budget, _sizeX, _temporal, isInView);
+    for (auto l : scheduled) isDirty[l] = true;
+
+    bool hasPending = false;
+    for (auto l : _data->_dirtyLights) {
+        if (isInView[l] && isDirty[l] == false) hasPending = true;
+    }
+    _data->_dirtyLights.clear();
+
+    if (scheduled.empty() == false || _data->_lightBinsChanged) {
+        uploadLights(scheduled);
+    }
+
+    int nRows = 0;
+
+    bool shadeAll = _data->_forceShade;
+    _data->_forceShade = false;
+    Rect shadeRect;
+
+    // lights that moved get their full row recomputed. after a local occupancy change the
+    // remaining lights only update the bins of the wedge that the changed cells project onto
+    {
+        Rect rect = changed;
+        if (_data->_spritesChanged) rect.add(_data->_spritesDirty);
+
+        lightIds.clear();
+        wedges.clear();
+
+        std::vector<cl_int> candidates;
+        for (int l = 0; l < _nLights; ++l) {
+            if (useStatic && _data->_lightIsStatic[l]) continue;
+            if (isDirty[l]) {
+                lightIds.push_back(l);
+            } else if (rect.empty() == false) {
+                if (isInView[l]) {
+                    candidates.push_back(l);
+                } else {
+                    _data->_lightAge[l] = -1;
+                }
+            }
+        }
+
+        Rect wedgesRect = _data->selectLightWedges(candidates, rect, _sizeX, _sizeY);
+        if (lightIds.empty() == false) shadeAll = true;
+        shadeRect.add(wedgesRect);
+
+        nRows += lightIds.size();
+        OCL::BaseManager::TimingScope rowsTiming(*_oclm, "calcShadowMap.rows");
+        calcLightRows("lightDistance", _data->_useObjectsFrame ? "objectsFrame" : "objects", wedgesRect);
+    }
+    _data->_spritesChanged = false;
+    _data->_spritesDirty = Rect();
+
+    if (useStatic) {
+        lightIds.clear();
+        wedges.clear();
+
+        std::vector<cl_int> candidates;
+        for (int l = 0; l < _nLights; ++l) {
+            if (_data->_lightIsStatic[l] == false) continue;
+            if (isDirty[l]) {
+                lightIds.push_back(l);
+            } else if (changed.empty() == false) {
+                if (isInView[l]) {
+                    candidates.push_back(l);
+                } else {
+                    _data->_lightAge[l] = -1;
+                }
+            }
+        }
+
+        Rect wedgesRect = _data->selectLightWedges(candidates, changed, _sizeX, _sizeY);
+
+        std::vector<bool> isRefreshed(_nLights, false);
+        for (auto l : lightIds) isRefreshed[l] = true;
+        for (const auto & wedge : wedges) isRefreshed[wedge.light] = true;
 
+        nRows += lightIds.size();
+        {
+            OCL::BaseManager::TimingScope rowsTiming(*_oclm, "calcShadowMap.rows");
+            calcLightRows("lightDistanceStatic", "objects", wedgesRect);
+        }
+
+        // static lights reached by a sprite use the cached row min-merged with the sprite cells,
+        // the rest use the cached row as is and are shaded from shadowStatic
+        const Rect & spritesRect = _data->_spritesRect;
+
+        bool cacheChanged = (_data->_shadowStaticValid == false);
+        std::vector<cl_int> copyIds;
+        std::vector<cl_int> cachedIds;
+        wedges.clear();
+        for (int l = 0; l < _nLights; ++l) {
+            if (_data->_lightIsStatic[l] == false) continue;
+
+            bool isAffected = _data->_useObjectsFrame && isInView[l] &&
+                Data::isInfluenced(_data->_lightsPrev[l], spritesRect, _sizeX, _sizeY);
+            if (isAffected != _data->_lightIsAffected[l]) cacheChanged = true;
+            if (isRefreshed[l] && isAffected == false) cacheChanged = true;
+
+            if (isRefreshed[l] || isAffected || _data->_lightIsAffected[l]) copyIds.push_back(l);
+            if (isAffected) {
+                CLIF::TypeLightWedge wedge;
+                wedge.light = l;
+                wedge.binStart = 0;
+                wedge.binCount = _data->_lightsPrev[l].nBins;
+                wedge.x0 = spritesRect.x0; wedge.y0 = spritesRect.y0;
+                wedge.x1 = spritesRect.x1; wedge.y1 = spritesRect.y1;
+                wedges.push_back(wedge);
+            } else {
+                cachedIds.push_back(l);
+            }
+
+            _data->_lightIsAffected[l] = isAffected;
+        }
+
+        if (copyIds.empty() == false) {
+            cl_int nCopy = copyIds.size();
+            _oclm->writeBuffer("lightIds", CL_FALSE, nCopy*sizeof(cl_int), copyIds.data());
+
+            _oclm->setKernelArgAsBuffer(kernels.copyLightDistance, 0, buffers.lightDistance);
+            _oclm->setKernelArgAsBuffer(kernels.copyLightDistance, 1, buffers.lightDistanceStatic);
+            _oclm->setKernelArgAsBuffer(kernels.copyLightDistance, 2, buffers.lights);
+            _oclm->setKernelArgAsBuffer(kernels.copyLightDistance, 3, buffers.lightIds);
+            _oclm->setKernelArg(kernels.copyLightDistance, 4, nCopy);
+            _oclm->setKernelArg(kernels.copyLightDistance, 5, _nLightAngles);
+            _oclm->runKernelSelected(kernels.copyLightDistance);
+
+            shadeAll = true;
+        }
+
+        if (wedges.empty() == false) {
+            _oclm->writeBuffer("lightWedges", CL_FALSE, wedges.size()*sizeof(CLIF::TypeLightWedge), wedges.data());
+            mergeLightWedges("lightDistance", "objectsFrame", spritesRect);
+        }
+
+        if (cacheChanged) {
+            const auto & tex = _textures["tex_shadowmap"];
+
+            cl_int nCached = cachedIds.size();
+            cl_uint nx = tex._sizeX;
+            cl_uint ny = tex._sizeY;
+
+            if (nCached > 0) {
+                _oclm->writeBuffer("shadeLightIds", CL_FALSE, nCached*sizeof(cl_int), cachedIds.data());
+            }
+
+            _oclm->setKernelArgAsBuffer(kernels.accumulateShadow, 0, buffers.shadowStatic);
+            _oclm->setKernelArgAsBuffer(kernels.accumulateShadow, 1, buffers.lights);
+            _oclm->setKernelArgAsBuffer(kernels.accumulateShadow, 2, buffers.lightDistance);
+            _oclm->setKernelArgAsBuffer(kernels.accumulateShadow, 3, buffers.shadeLightIds);
+            _oclm->setKernelArg(kernels.accumulateShadow, 4, nCached);
+            _oclm->setKernelArg(kernels.accumulateShadow, 5, _softSize);
+            _oclm->setKernelArg(kernels.accumulateShadow, 6, nx);
+            _oclm->setKernelArg(kernels.accumulateShadow, 7, ny);
+            _oclm->runKernelSelected(kernels.accumulateShadow);
+
+            _data->_shadowStaticValid = true;
+            shadeAll = true;
+        }
+    }
+
+    _data->_rowsLast = nRows;
+
+    // the checkerboard leaves half of the pixels behind, keep shading until the history converged
+    if (_temporal) {
+        if (shadeAll || shadeRect.empty() == false) {
+            _data->_temporalFramesLeft = kTemporalFrames;
+        } else if (_data->_temporalFramesLeft > 0) {
+            --_data->_temporalFramesLeft;
+            shadeAll = true;
+        }
+    }
+
+    _isIdle = (shadeAll == false) && shadeRect.empty() && (hasPending == false);
+    if ((shadeAll == false) && shadeRect.empty()) return;
+
+    // re-shade the whole view if a full row changed, otherwise only the pixels inside the wedges
+    if (shadeAll || _temporal) shadeRect = viewRect;
+    shadeRect = intersect(shadeRect, viewRect);
+    if (shadeRect.empty()) return;
+
+    const auto & tex = _textures["tex_shadowmap"];
+    {
+        Rect rect = shadeRect;
+        shadeRect.x0 = (rect.x0*tex._sizeX)/_sizeX;
+        shadeRect.y0 = (rect.y0*tex._sizeY)/_sizeY;
+        shadeRect.x1 = std::min(((rect.x1 + 1)*tex._sizeX + _sizeX - 1)/_sizeX, tex._sizeX) - 1;
+        shadeRect.y1 = std::min(((rect.y1 + 1)*tex._sizeY + _sizeY - 1)/_sizeY, tex._sizeY) - 1;
+    }
+
+    std::vector<cl_int> shadeIds;
+    for (int l = 0; l < _nLights; ++l) {
+        if (isInView[l] == false) continue;
+        if (useStatic && _data->_lightIsStatic[l] && _data->_lightIsAffected[l] == false) continue;
+        shadeIds.push_back(l);
+    }
+
+    shadeLights(shadeIds, useStatic, shadeRect);
+
+    _data->_frameTimed = true;
+}
+
+void Geometry::setViewRect(float fx0, float fy0, float fx1, float fy1, int nPixelsX) {
+    if (_sizeX <= 0) return;
+
+    fx0 = std::max(fx0, -1.0f); fx1 = std::min(fx1, 1.0f);
+    fy0 = std::max(fy0, -1.0f); fy1 = std::min(fy1, 1.0f);
+    if (fx0 >= fx1 || fy0 >= fy1) return;
+
+    // pick the coarsest shadow map that still has a texel per screen pixel
+    if (nPixelsX > 0 && _targetFrameTime <= 0.0f) {
+        float cells = 0.5f*(fx1 - fx0)*_sizeX;
+        int scale = 1;
+        while (2*scale <= 8 && cells/(2*scale) >= nPixelsX) scale *= 2;
+        setShadowMapScale(scale);
+    }
+
+    if (fx0 == _viewX0 && fy0 == _viewY0 && fx1 == _viewX1 && fy1 == _viewY1) return;
+
+    _viewX0 = fx0; _viewY0 = fy0;
+    _viewX1 = fx1; _viewY1 = fy1;
+
+    updateViewRect();
+}
+
+void Geometry::updateViewRect() {
+    _data->_viewRect = Rect::make(
+            std::max((int) std::floor(0.5f*(_viewX0 + 1.0f)*_sizeX), 0),
+            std::max((int) std::floor(0.5f*(_viewY0 + 1.0f)*_sizeY), 0),
+            std::min((int) std::ceil(0.5f*(_viewX1 + 1.0f)*_sizeX), _sizeX) - 1,
+            std::min((int) std::ceil(0.5f*(_viewY1 + 1.0f)*_sizeY), _sizeY) - 1);
+    _data->_forceShade = true;
+}
+
+void Geometry::viewToWorld(float & fx, float & fy) const {
+    fx = _viewX0 + 0.5f*(fx + 1.0f)*(_viewX1 - _viewX0);
+    fy = _viewY0 + 0.5f*(fy + 1.0f)*(_viewY1 - _viewY0);
+}
+
+void Geometry::updateQuality(float frameTime) {
+    auto & data = *_data;
+
+    if (data._qualityLevel < 0) {
+        data._qualityLevel = 0;
+        for (int i = 0; i < kNumQualityLevels; ++i) {
+            if (kQualityLevels[i].nLightAngles <= _nLightAngles) data._qualityLevel = i;
+        }
+    }
+
+    data._frameTime = (data._frameTime > 0.0f) ? 0.9f*data._frameTime + 0.1f*frameTime : frameTime;
+
+    // hysteresis - drop quickly when over budget, raise only after a long stretch well below it
+    if (data._frameTime > 1.1f*_targetFrameTime) {
+        ++data._nSlowFrames;
+        data._nFastFrames = 0;
+    } else if (data._frameTime < 0.6f*_targetFrameTime) {
+        ++data._nFastFrames;
+        data._nSlowFrames = 0;
+    } else {
+        data._nSlowFrames = 0;
+        data._nFastFrames = 0;
+    }
+
+    int level = data._qualityLevel;
+    if (data._nSlowFrames >= kSlowFramesToSwitch && level > 0) --level;
+    if (data._nFastFrames >= kFastFramesToSwitch && level < kNumQualityLevels - 1) ++level;
+    if (level == data._qualityLevel) return;
+
+    data._qualityLevel = level;
+    data._frameTime = 0.0f;
+    data._nSlowFrames = 0;
+    data._nFastFrames = 0;
+
+    const auto & q = kQualityLevels[level];
+    setLightAngles(q.nLightAngles);
+    setShadowMapScale(q.shadowMapScale);
+    _upsample = q.upsample;
+    if (_softSize != q.softSize) {
+        _softSize = q.softSize;
+        data._shadowStaticValid = false;
+        data._forceShade = true;
+    }
+}
+
+// the refreshed lights reach the device as refresh records applied by animateLights, the
+// lights themselves are uploaded only when a field the records do not carry was edited
+void Geometry::uploadLights(const std::vector<int> & scheduled) {
+    const auto & kernels = _data->_kernels;
+    const auto & buffers = _data->_buffers;
+    const auto & lightsPrev = _data->_lightsPrev;
+    const auto & anims = *_data->_lightAnims;
+    auto & device = _data->_lightsDevice;
+    auto & refresh = *_data->_lightRefresh;
+
+    if (_data->_lightAnimsChanged) {
+        cl_int nKeys = _data->_lightKeys->size();
+        if (nKeys > _data->_lightKeysCapacity || _data->_lightKeysCapacity == 0) {
+            _data->_lightKeysCapacity = std::max(16, 2*nKeys);
+            _oclm->allocateOpenCLBuffer("lightKeys",
+                    (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ,
+                    _data->_lightKeysCapacity*sizeof(CLIF::TypeLightKey), NULL);
+        }
+        if (nKeys > 0) {
+            _oclm->writeBuffer("lightKeys", CL_FALSE, nKeys*sizeof(CLIF::TypeLightKey), _data->_lightKeys->data());
+        }
+        _oclm->writeBuffer("lightAnims", CL_FALSE, _nLights*sizeof(CLIF::TypeLightAnim), anims.data());
+        _data->_lightAnimsChanged = false;
+    }
+
+    // lights with an edited field are uploaded as a whole, the others only get a refresh record
+    const bool isFullUpload = _data->_lightBinsChanged || (int) device.size() != _nLights;
+    auto & uploads = _data->_lightUploads;
+    uploads.clear();
+    if (isFullUpload) {
+        for (int l = 0; l < _nLights; ++l) uploads.push_back(l);
+    }
+
+    refresh.clear();
+    for (auto l : scheduled) {
+        if (isFullUpload) continue;
+        if (Data::hasLightFieldsChanged(lightsPrev[l], device[l])) {
+            uploads.push_back(l);
+            continue;
+        }
+
+        CLIF::TypeLightRefresh r;
+        r.light = l;
+        r.animate = _animateLights && _data->_lightIsStatic[l] == false && anims[l].type != LIGHT_ANIM_NONE;
+        r.binShift = lightsPrev[l].binShift;
+        r.x0 = lightsPrev[l].x0;
+        r.y0 = lightsPrev[l].y0;
+        refresh.push_back(r);
+    }
+
+    // the changes are written in place, one non-blocking write per run of lights. the queue
+    // orders them after the kernels of the previous frame that read the buffer
+    std::sort(uploads.begin(), uploads.end());
+    for (int i = 0; i < (int) uploads.size(); ) {
+        int n = 1;
+        while (i + n < (int) uploads.size() && uploads[i + n] == uploads[i] + n) ++n;
+        _oclm->writeBuffer("lights", CL_FALSE, uploads[i]*sizeof(CLIF::TypeLight2D),
+                           n*sizeof(CLIF::TypeLight2D), lightsPrev.data() + uploads[i]);
+        i += n;
+    }
+
+    if (refresh.empty() == false) {
+        cl_int nRefresh = refresh.size();
+        cl_float time = _data->_animTime;
+
+        _oclm->writeBuffer("lightRefresh", CL_FALSE, nRefresh*sizeof(CLIF::TypeLightRefresh), refresh.data());
+
+        _oclm->setKernelArgAsBuffer(kernels.animateLights, 0, buffers.lights);
+        _oclm->setKernelArgAsBuffer(kernels.animateLights, 1, buffers.lightAnims);
+        _oclm->setKernelArgAsBuffer(kernels.animateLights, 2, buffers.lightKeys);
+        _oclm->setKernelArgAsBuffer(kernels.animateLights, 3, buffers.lightRefresh);
+        _oclm->setKernelArg(kernels.animateLights, 4, nRefresh);
+        _oclm->setKernelArg(kernels.animateLights, 5, time);
+        _oclm->runKernelSelected(kernels.animateLights);
+    }
+
+    device = lightsPrev;
+    _data->_lightBinsChanged = false;
+}
+
+void Geometry::setLightAngles(int nLightAngles) {
+    if (nLightAngles == _nLightAngles) return;
+
+    _nLightAngles = nLightAngles;
+    if (_sizeX > 0) allocateLightDistance();
+}
+
+void Geometry::setShadowMapScale(int scale) {
+    if (scale == _shadowMapScale) return;
+
+    _shadowMapScale = scale;
+    if (_sizeX > 0) allocateShadowMap();
+}
+
+// the row kernel is tuned before the first frame for a few light counts, the frames use the
+// result of the nearest one. the scene may still be empty, so the kernel runs on a fixed pattern
+// of occluders in scratch buffers
+void Geometry::autotune() {
+    if (_autotune == false || _nLights == 0) return;
+
+    const auto & kernels = _data->_kernels;
+    const auto & buffers = _data->_buffers;
+    const auto & lights = *_data->_lights;
+
+    // the device copy of the lights does not have the row layout until the first frame
+    _oclm->writeBuffer("lights", CL_TRUE, _nLights*sizeof(CLIF::TypeLight2D), lights.data());
+
+    std::vector<cl_int> ids(_nLights);
+    for (int l = 0; l < _nLights; ++l) ids[l] = l;
+    _oclm->writeBuffer("lightIds", CL_TRUE, _nLights*sizeof(cl_int), ids.data());
+
+    std::vector<CLIF::TypeObject> objects(_sizeX*_sizeY, 0.0f);
+    for (int y = 0; y < _sizeY; ++y) {
+        for (int x = 0; x < _sizeX; ++x) {
+            if (x % kTuneOccluderSpacing < kTuneOccluderSize && y % kTuneOccluderSpacing < kTuneOccluderSize) {
+                objects[y*_sizeX + x] = 1.0f;
+            }
+        }
+    }
+    _oclm->allocateOpenCLBuffer("tuneObjects",
+            (OCL::BaseManager::CLFlags) (OCL::BaseManager::CLFlags::MEM_READ | OCL::BaseManager::CLFlags::MEM_COPY_HOST_PTR),
+            objects.size()*sizeof(CLIF::TypeObject), objects.data());
+    _oclm->allocateOpenCLBuffer("tuneDistance",
+            (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ_WRITE,
+            _data->_lightDistanceSize*sizeof(cl_float), NULL);
+    _oclm->fillBufferFloat("tuneDistance", 100.0f, _data->_lightDistanceSize);
+
+    cl_uint nx = _sizeX;
+    cl_uint ny = _sizeY;
+    _oclm->setKernelArgAsBuffer(kernels.calcDistance2, 0, _oclm->getBufferHandle("tuneObjects"));
+    _oclm->setKernelArgAsBuffer(kernels.calcDistance2, 1, buffers.lights);
+    _oclm->setKernelArgAsBuffer(kernels.calcDistance2, 2, _oclm->getBufferHandle("tuneDistance"));
+    _oclm->setKernelArgAsBuffer(kernels.calcDistance2, 3, buffers.lightIds);
+    _oclm->setKernelArg(kernels.calcDistance2, 5, nx);
+    _oclm->setKernelArg(kernels.calcDistance2, 6, ny);
+
+    int n = _nLights;
+    for (int i = 0; i < 3 && n > 0; ++i, n /= 4) {
+        cl_int nLightIds = n;
+        _oclm->setKernelArg(kernels.calcDistance2, 4, nLightIds);
+        _oclm->autotuneKernel(kernels.calcDistance2, _sizeX*_sizeY*n, kTuneWorkload);
+    }
+
+    _oclm->deallocateOpenCLObject("tuneObjects");
+    _oclm->deallocateOpenCLObject("tuneDistance");
+    _oclm->releaseBufferPool();
+}
+
+void Geometry::calcLightRows(const std::string & distance, const std::string & objects, const Rect & wedgesRect) {
+    const auto & kernels = _data->_kernels;
+    const auto & buffers = _data->_buffers;
+    const auto bDistance = _oclm->getBufferHandle(distance);
+    const auto bObjects = _oclm->getBufferHandle(objects);
+    auto & lightIds = *_data->_lightIds;
+    auto & wedges = *_data->_lightWedges;
+
+    // the segments pass handles both kinds of lights - it min-merges into the whole row
+    cl_int nLightIds = lightIds.size();
+    cl_int nWedges = wedges.size();
+    if (nLightIds == 0 && nWedges == 0) return;
+
+    for (const auto & wedge : wedges) lightIds.push_back(wedge.light);
+
+    _oclm->writeBuffer("lightIds", CL_FALSE, lightIds.size()*sizeof(cl_int), lightIds.data());
+
+    cl_float val = 100.0f;
     cl_uint nx = _sizeX;
     cl_uint ny = _sizeY;
 
-    _oclm->setKernelArgAsBuffer("calcDistance2", 0, "objects");
-    _oclm->setKernelArgAsBuffer("calcDistance2", 1, "lights");
-    _oclm->setKernelArgAsBuffer("calcDistance2", 2, "lightDistance");
-    _oclm->setKernelArg("calcDistance2", 3, sizeof(cl_int),  &_nLights);
-    _oclm->setKernelArg("calcDistance2", 4, sizeof(cl_int),  &_nLightAngles);
-    _oclm->setKernelArg("calcDistance2", 5, sizeof(cl_uint), &nx);
-    _oclm->setKernelArg("calcDistance2", 6, sizeof(cl_uint), &ny);
-    _oclm->runKernelSelected("calcDistance2");
+    if (nLightIds == _nLights) {
+        // the rows are not used by anything queued before, the fill can overlap the uploads
+        const OCL::BaseManager::EventList noDependencies;
+        _oclm->fillBufferFloat(distance, val, _data->_lightDistanceSize, &noDependencies);
+    } else if (nLightIds > 0) {
+        _oclm->setKernelArgAsBuffer(kernels.resetLightDistance, 0, bDistance);
+        _oclm->setKernelArgAsBuffer(kernels.resetLightDistance, 1, buffers.lights);
+        _oclm->setKernelArgAsBuffer(kernels.resetLightDistance, 2, buffers.lightIds);
+        _oclm->setKernelArg(kernels.resetLightDistance, 3, nLightIds);
+        _oclm->setKernelArg(kernels.resetLightDistance, 4, _nLightAngles);
+        _oclm->setKernelArg(kernels.resetLightDistance, 5, val);
+        _oclm->runKernelSelected(kernels.resetLightDistance);
+    }
+
+    if (nLightIds > 0) {
+        _oclm->setKernelArgAsBuffer(kernels.calcDistance2, 0, bObjects);
+        _oclm->setKernelArgAsBuffer(kernels.calcDistance2, 1, buffers.lights);
+        _oclm->setKernelArgAsBuffer(kernels.calcDistance2, 2, bDistance);
+        _oclm->setKernelArgAsBuffer(kernels.calcDistance2, 3, buffers.lightIds);
+        _oclm->setKernelArg(kernels.calcDistance2, 4, nLightIds);
+        _oclm->setKernelArg(kernels.calcDistance2, 5, nx);
+        _oclm->setKernelArg(kernels.calcDistance2, 6, ny);
+
+        if (_autotune) _oclm->selectTunedKernel(kernels.calcDistance2, _sizeX*_sizeY*nLightIds, kTuneWorkload);
+        _oclm->runKernelSelected(kernels.calcDistance2);
+    }
+
+    if (nWedges > 0) {
+        _oclm->writeBuffer("lightWedges", CL_FALSE, nWedges*sizeof(CLIF::TypeLightWedge), wedges.data());
+
+        _oclm->setKernelArgAsBuffer(kernels.resetLightDistanceWedges, 0, bDistance);
+        _oclm->setKernelArgAsBuffer(kernels.resetLightDistanceWedges, 1, buffers.lights);
+        _oclm->setKernelArgAsBuffer(kernels.resetLightDistanceWedges, 2, buffers.lightWedges);
+        _oclm->setKernelArg(kernels.resetLightDistanceWedges, 3, nWedges);
+        _oclm->setKernelArg(kernels.resetLightDistanceWedges, 4, _nLightAngles);
+        _oclm->setKernelArg(kernels.resetLightDistanceWedges, 5, val);
+        _oclm->runKernelSelected(kernels.resetLightDistanceWedges);
+
+        mergeLightWedges(distance, objects, wedgesRect);
+    }
+
+    cl_int nSegments = _data->_segments->size();
+    if (nSegments > 0) {
+        cl_int nSegmentLights = lightIds.size();
+
+        _oclm->setKernelArgAsBuffer(kernels.calcDistanceSegments, 0, buffers.segments);
+        _oclm->setKernelArgAsBuffer(kernels.calcDistanceSegments, 1, buffers.lights);
+        _oclm->setKernelArgAsBuffer(kernels.calcDistanceSegments, 2, bDistance);
+        _oclm->setKernelArgAsBuffer(kernels.calcDistanceSegments, 3, buffers.lightIds);
+        _oclm->setKernelArg(kernels.calcDistanceSegments, 4, nSegments);
+        _oclm->setKernelArg(kernels.calcDistanceSegments, 5, nSegmentLights);
+        _oclm->runKernelSelected(kernels.calcDistanceSegments);
+    }
+}
+
+// min-merges the cells of rect into the bins of the uploaded wedges
+void Geometry::mergeLightWedges(const std::string & distance, const std::string & objects, const Rect & rect) {
+    const auto & kernels = _data->_kernels;
+    const auto & buffers = _data->_buffers;
+    const auto bDistance = _oclm->getBufferHandle(distance);
+    const auto bObjects = _oclm->getBufferHandle(objects);
+    const auto & wedges = *_data->_lightWedges;
+
+    cl_int nWedges = wedges.size();
+    cl_uint nx = _sizeX;
+    cl_uint ny = _sizeY;
+    cl_uint x0 = rect.x0;
+    cl_uint y0 = rect.y0;
+    cl_uint rnx = rect.x1 - rect.x0 + 1;
+    cl_uint rny = rect.y1 - rect.y0 + 1;
+
+    _oclm->setKernelArgAsBuffer(kernels.calcDistanceWedges, 0, bObjects);
+    _oclm->setKernelArgAsBuffer(kernels.calcDistanceWedges, 1, buffers.lights);
+    _oclm->setKernelArgAsBuffer(kernels.calcDistanceWedges, 2, bDistance);
+    _oclm->setKernelArgAsBuffer(kernels.calcDistanceWedges, 3, buffers.lightWedges);
+    _oclm->setKernelArg(kernels.calcDistanceWedges, 4, nWedges);
+    _oclm->setKernelArg(kernels.calcDistanceWedges, 5, nx);
+    _oclm->setKernelArg(kernels.calcDistanceWedges, 6, ny);
+    _oclm->setKernelArg(kernels.calcDistanceWedges, 7, x0);
+    _oclm->setKernelArg(kernels.calcDistanceWedges, 8, y0);
+    _oclm->setKernelArg(kernels.calcDistanceWedges, 9, rnx);
+    _oclm->setKernelArg(kernels.calcDistanceWedges, 10, rny);
+    _oclm->runKernelSelected(kernels.calcDistanceWedges);
+}
+
+void Geometry::shadeLights(const std::vector<int> & lightIds, bool useBase, const Rect & rect) {
+    const auto & kernels = _data->_kernels;
+    const auto & buffers = _data->_buffers;
+    const auto & tex = _textures["tex_shadowmap"];
+
+    CLIF::TypeShadeParams params;
+    params.nLightIds = lightIds.size();
+    params.useBase = useBase ? 1 : 0;
+    params.softSize = _softSize;
+    params.nLights = _nLights;
+    params.sizeX = tex._sizeX;
+    params.sizeY = tex._sizeY;
+    params.x0 = rect.x0;
+    params.y0 = rect.y0;
+    params.nx = rect.x1 - rect.x0 + 1;
+    params.ny = rect.y1 - rect.y0 + 1;
+    params.temporal = TEMPORAL_OFF;
+    params.parity = 0;
+
+    if (params.nLightIds > 0) {
+        _oclm->writeBuffer("shadeLightIds", CL_FALSE, params.nLightIds*sizeof(cl_int), lightIds.data());
+    }
+
+    // motion of each light since the last shading, in shadow map pixels
+    if (_temporal) {
+        const auto & lights = _data->_lightsPrev;
+        auto & lightsShaded = _data->_lightsShaded;
+        auto & motion = _data->_lightMotion;
+
+        if ((int) lightsShaded.size() != _nLights) {
+            lightsShaded = lights;
+            _data->_historyValid = false;
+        }
+
+        for (int l = 0; l < _nLights; ++l) {
+            float dx = lights[l].x0 - lightsShaded[l].x0;
+            float dy = lights[l].y0 - lightsShaded[l].y0;
+            motion[l] = 0.5f*std::sqrt(dx*dx + dy*dy)*tex._sizeX;
+            if (lights[l].size != lightsShaded[l].size || lights[l].falloff != lightsShaded[l].falloff ||
+                lights[l].intensity != lightsShaded[l].intensity ||
+                lights[l].dir.s[0] != lightsShaded[l].dir.s[0] || lights[l].dir.s[1] != lightsShaded[l].dir.s[1] ||
+                lights[l].ang != lightsShaded[l].ang) motion[l] = 1.0f;
+        }
+        lightsShaded = lights;
+
+        _oclm->writeBuffer("lightMotion", CL_FALSE, _nLights*sizeof(cl_float), motion.data());
+
+        params.temporal = _data->_historyValid ? TEMPORAL_ACCUMULATE : TEMPORAL_RESET;
+        params.parity = (_data->_frame++) & 1;
+        _data->_historyValid = true;
+    }
 
     _oclm->acquireGLObject("tex_shadowmap");
 
-    nx = _textures["tex_shadowmap"]._sizeX;
-    ny = _textures["tex_shadowmap"]._sizeY;
-    _oclm->setKernelArgAsBuffer("calcShadowMap2", 0, "tex_shadowmap");
-    _oclm->setKernelArgAsBuffer("calcShadowMap2", 1, "lights");
-    _oclm->setKernelArgAsBuffer("calcShadowMap2", 2, "lightDistance");
-    _oclm->setKernelArg("calcShadowMap2", 3, sizeof(cl_int),  &_nLights);
-    _oclm->setKernelArg("calcShadowMap2", 4, sizeof(cl_int),  &_nLightAngles);
-    _oclm->setKernelArg("calcShadowMap2", 5, sizeof(cl_uint), &nx);
-    _oclm->setKernelArg("calcShadowMap2", 6, sizeof(cl_uint), &ny);
-    _oclm->runKernelSelected("calcShadowMap2");
+    _oclm->setKernelArgAsBuffer(kernels.calcShadowMap2, 0, buffers.texShadowmap);
+    _oclm->setKernelArgAsBuffer(kernels.calcShadowMap2, 1, buffers.lights);
+    _oclm->setKernelArgAsBuffer(kernels.calcShadowMap2, 2, buffers.lightDistance);
+    _oclm->setKernelArgAsBuffer(kernels.calcShadowMap2, 3, buffers.shadeLightIds);
+    _oclm->setKernelArgAsBuffer(kernels.calcShadowMap2, 4, buffers.shadowStatic);
+    _oclm->setKernelArgAsBuffer(kernels.calcShadowMap2, 5, buffers.shadowHistory);
+    _oclm->setKernelArgAsBuffer(kernels.calcShadowMap2, 6, buffers.lightMotion);
+    _oclm->setKernelArg(kernels.calcShadowMap2, 7, params);
+    _oclm->runKernelSelected(kernels.calcShadowMap2);
 
     _oclm->releaseGLObject("tex_shadowmap");
+
+    _data->_shadeParams = params;
+    if (_upsample) upsampleShadowMap();
+}
+
+void Geometry::upsampleShadowMap() {
+    const auto & kernels = _data->_kernels;
+    const auto & buffers = _data->_buffers;
+    const auto & params = _data->_shadeParams;
+
+    cl_int refine = _refineEdges ? 1 : 0;
+
+    _oclm->setKernelArgAsBuffer(kernels.upsampleShadow, 0, buffers.texShadowfull);
+    _oclm->setKernelArgAsBuffer(kernels.upsampleShadow, 1, buffers.shadowHistory);
+    _oclm->setKernelArgAsBuffer(kernels.upsampleShadow, 2, _data->_useObjectsFrame ? buffers.objectsFrame : buffers.objects);
+    _oclm->setKernelArgAsBuffer(kernels.upsampleShadow, 3, buffers.lights);
+    _oclm->setKernelArgAsBuffer(kernels.upsampleShadow, 4, buffers.lightDistance);
+    _oclm->setKernelArgAsBuffer(kernels.upsampleShadow, 5, buffers.shadeLightIds);
+    _oclm->setKernelArgAsBuffer(kernels.upsampleShadow, 6, buffers.shadowStatic);
+    _oclm->setKernelArgAsBuffer(kernels.upsampleShadow, 7, buffers.lightMotion);
+    _oclm->setKernelArg(kernels.upsampleShadow, 8, params);
+    _oclm->setKernelArg(kernels.upsampleShadow, 9, refine);
+    _oclm->setKernelArg(kernels.upsampleShadow, 10, _refineThreshold);
+
+    // only the view, grown to whole 8x8 workgroups
+    const Rect & view = _data->_viewRect;
+    int wgs = (_sizeX % 8 == 0 && _sizeY % 8 == 0) ? 8 : 1;
+    cl_uint nx = _sizeX;
+    cl_uint ny = _sizeY;
+    cl_uint x0 = (view.x0/wgs)*wgs;
+    cl_uint y0 = (view.y0/wgs)*wgs;
+    int gx = ((view.x1 + wgs)/wgs)*wgs - x0;
+    int gy = ((view.y1 + wgs)/wgs)*wgs - y0;
+
+    _oclm->setKernelArg(kernels.upsampleShadow, 11, nx);
+    _oclm->setKernelArg(kernels.upsampleShadow, 12, ny);
+    _oclm->setKernelArg(kernels.upsampleShadow, 13, x0);
+    _oclm->setKernelArg(kernels.upsampleShadow, 14, y0);
+
+    _oclm->acquireGLObject("tex_shadowfull");
+    _oclm->runKernel2D(kernels.upsampleShadow, gx, gy, wgs, wgs);
+    _oclm->releaseGLObject("tex_shadowfull");
+}
+
+void Geometry::setLightStatic(int l, bool isStatic) {
+    if (l < 0 || l >= (int) _data->_lightIsStatic.size()) return;
+    if (_data->_lightIsStatic[l] == isStatic) return;
+
+    _data->_lightIsStatic[l] = isStatic;
+    _data->_lightIsAffected[l] = false;
+    _data->_shadowStaticValid = false;
+    _data->_spritesChanged = false;
+    _data->_spritesDirty = Rect();
+    _data->markObjectsChanged(_sizeX, _sizeY);
+}
+
+void Geometry::setLightPath(int l, float cx, float ax, float wx, float px, float cy, float ay, float wy, float py) {
+    if (l < 0 || l >= (int) _data->_lightAnims->size()) return;
+
+    auto & anim = (*_data->_lightAnims)[l];
+    anim.type = LIGHT_ANIM_PATH;
+    anim.pathX = { {cx, ax, wx, px} };
+    anim.pathY = { {cy, ay, wy, py} };
+    _data->_lightAnimsChanged = true;
+}
+
+void Geometry::setLightKeyframes(int l, const float * txy, int nKeys, float period) {
+    if (l < 0 || l >= (int) _data->_lightAnims->size()) return;
+    if (nKeys <= 0 || period <= 0.0f) return;
+
+    auto & keys = _data->_lightKeyLists[l];
+    keys.resize(nKeys);
+    for (int i = 0; i < nKeys; ++i) {
+        keys[i].t = txy[3*i + 0];
+        keys[i].x = txy[3*i + 1];
+        keys[i].y = txy[3*i + 2];
+        keys[i].padding = 0.0f;
+    }
+    std::sort(keys.begin(), keys.end(),
+            [](const CLIF::TypeLightKey & a, const CLIF::TypeLightKey & b) { return a.t < b.t; });
+
+    auto & anim = (*_data->_lightAnims)[l];
+    anim.type = LIGHT_ANIM_KEYFRAMES;
+    anim.t0 = _data->_animTime;
+    anim.period = period;
+    anim.nKeys = nKeys;
+    _data->rebuildLightKeys();
+}
+
+void Geometry::setLightVelocity(int l, float vx, float vy) {
+    if (l < 0 || l >= (int) _data->_lightAnims->size()) return;
+
+    const auto & light = _data->_lights->at(l);
+
+    auto & anim = (*_data->_lightAnims)[l];
+    anim.type = LIGHT_ANIM_VELOCITY;
+    anim.t0 = _data->_animTime;
+    anim.origin = { {light.x0, light.y0} };
+    anim.velocity = { {vx, vy} };
+    _data->_lightAnimsChanged = true;
+}
+
+void Geometry::clearLightAnimation(int l) {
+    if (l < 0 || l >= (int) _data->_lightAnims->size()) return;
+
+    (*_data->_lightAnims)[l].type = LIGHT_ANIM_NONE;
+    if (_data->_lightKeyLists[l].empty() == false) {
+        _data->_lightKeyLists[l].clear();
+        (*_data->_lightAnims)[l].nKeys = 0;
+        _data->rebuildLightKeys();
+    }
+    _data->_lightAnimsChanged = true;
+}
+
+bool Geometry::isLightStatic(int l) const {
+    if (l < 0 || l >= (int) _data->_lightIsStatic.size()) return false;
+    return _data->_lightIsStatic[l];
 }
 
 void Geometry::finishOpenCL() { _oclm->finish(); }
 
 void Geometry::renderScene() {
+    // texture coordinates of the view
+    const float u0 = 0.5f*(_viewX0 + 1.0f);
+    const float v0 = 0.5f*(_viewY0 + 1.0f);
+    const float u1 = 0.5f*(_viewX1 + 1.0f);
+    const float v1 = 0.5f*(_viewY1 + 1.0f);
+
     glClearColor(0.1, 0.15, 0.20, 0.1);
 
     glEnable(GL_BLEND);
@@ -218,49 +1848,75 @@ void Geometry::renderScene() {
     glBindTexture(GL_TEXTURE_2D, _textures["tex_floor"].glid);
 
     glBegin(GL_QUADS);
-    glTexCoord2f(0, 0); glVertex2f(-1.0f, -1.0f);
-    glTexCoord2f(0, 1); glVertex2f(-1.0f,  1.0f);
-    glTexCoord2f(1, 1); glVertex2f( 0.0f,  1.0f);
-    glTexCoord2f(1, 0); glVertex2f( 0.0f, -1.0f);
+    glTexCoord2f(u0, v0); glVertex2f(-1.0f, -1.0f);
+    glTexCoord2f(u0, v1); glVertex2f(-1.0f,  1.0f);
+    glTexCoord2f(u1, v1); glVertex2f( 0.0f,  1.0f);
+    glTexCoord2f(u1, v0); glVertex2f( 0.0f, -1.0f);
     glEnd();
 
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glBindTexture(GL_TEXTURE_2D, _textures["tex_data"].glid);
 
     glBegin(GL_QUADS);
-    glTexCoord2f(0, 0); glVertex2f(-1.0f, -1.0f);
-    glTexCoord2f(0, 1); glVertex2f(-1.0f,  1.0f);
-    glTexCoord2f(1, 1); glVertex2f( 0.0f,  1.0f);
-    glTexCoord2f(1, 0); glVertex2f( 0.0f, -1.0f);
+    glTexCoord2f(u0, v0); glVertex2f(-1.0f, -1.0f);
+    glTexCoord2f(u0, v1); glVertex2f(-1.0f,  1.0f);
+    glTexCoord2f(u1, v1); glVertex2f( 0.0f,  1.0f);
+    glTexCoord2f(u1, v0); glVertex2f( 0.0f, -1.0f);
     glEnd();
 
+    if (_data->_segments->size() > 0) {
+        glDisable(GL_TEXTURE_2D);
+        glColor4f(1.0f, 0.0f, 0.0f, 1.0f);
+
+        // world to the left half of the screen through the view
+        const float sx = 1.0f/(_viewX1 - _viewX0);
+        const float sy = 2.0f/(_viewY1 - _viewY0);
+
+        glBegin(GL_LINES);
+        for (const auto & segment : *_data->_segments) {
+            glVertex2f(sx*(segment.x0 - _viewX0) - 1.0f, sy*(segment.y0 - _viewY0) - 1.0f);
+            glVertex2f(sx*(segment.x1 - _viewX0) - 1.0f, sy*(segment.y1 - _viewY0) - 1.0f);
+        }
+        glEnd();
+
+        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+        glEnable(GL_TEXTURE_2D);
+    }
+
     glBlendFunc(GL_ZERO, GL_SRC_ALPHA);
-    glBindTexture(GL_TEXTURE_2D, _textures["tex_shadowmap"].glid);
+    glBindTexture(GL_TEXTURE_2D, _textures[_upsample ? "tex_shadowfull" : "tex_shadowmap"].glid);
 
     glBegin(GL_QUADS);
-    glTexCoord2f(0, 0); glVertex2f(-1.0f, -1.0f);
-    glTexCoord2f(0, 1); glVertex2f(-1.0f,  1.0f);
-    glTexCoord2f(1, 1); glVertex2f( 0.0f,  1.0f);
-    glTexCoord2f(1, 0); glVertex2f( 0.0f, -1.0f);
+    glTexCoord2f(u0, v0); glVertex2f(-1.0f, -1.0f);
+    glTexCoord2f(u0, v1); glVertex2f(-1.0f,  1.0f);
+    glTexCoord2f(u1, v1); glVertex2f( 0.0f,  1.0f);
+    glTexCoord2f(u1, v0); glVertex2f( 0.0f, -1.0f);
     glEnd();
 }
 
 void Geometry::renderShadowMap() {
+    const float u0 = 0.5f*(_viewX0 + 1.0f);
+    const float v0 = 0.5f*(_viewY0 + 1.0f);
+    const float u1 = 0.5f*(_viewX1 + 1.0f);
+    const float v1 = 0.5f*(_viewY1 + 1.0f);
+
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
     glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, _textures["tex_shadowmap"].glid);
+    glBindTexture(GL_TEXTURE_2D, _textures[_upsample ? "tex_shadowfull" : "tex_shadowmap"].glid);
 
     glBegin(GL_QUADS);
-    glTexCoord2f(0, 0); glVertex2f(-0.0f, -1.0f);
-    glTexCoord2f(0, 1); glVertex2f(-0.0f,  1.0f);
-    glTexCoord2f(1, 1); glVertex2f( 1.0f,  1.0f);
-    glTexCoord2f(1, 0); glVertex2f( 1.0f, -1.0f);
+    glTexCoord2f(u0, v0); glVertex2f(-0.0f, -1.0f);
+    glTexCoord2f(u0, v1); glVertex2f(-0.0f,  1.0f);
+    glTexCoord2f(u1, v1); glVertex2f( 1.0f,  1.0f);
+    glTexCoord2f(u1, v0); glVertex2f( 1.0f, -1.0f);
     glEnd();
 }
 
 void Geometry::addObjectCircle(double fx, double fy, int r, float val) {
+    syncObjects();
+
     int x = 0.5*(fx + 1.0)*_sizeX;
     int y = 0.5*(fy + 1.0)*_sizeY;
 
@@ -276,14 +1932,253 @@ void Geometry::addObjectCircle(double fx, double fy, int r, float val) {
 }
 
 void Geometry::clear() {
+    _data->_stamps->clear();
+    _data->_objectsOnHost = true;
+
     auto & objects = *_data->_objects;
     for (int i = 0; i < _sizeX*_sizeY; ++i) objects[i] = 0;
 }
 
+void Geometry::stampCircle(double fx, double fy, int r, float val) {
+    int x = 0.5*(fx + 1.0)*_sizeX;
+    int y = 0.5*(fy + 1.0)*_sizeY;
+
+    CLIF::TypeStamp stamp;
+    stamp.type = STAMP_CIRCLE;
+    stamp.x0 = x; stamp.y0 = y;
+    stamp.x1 = x; stamp.y1 = y;
+    stamp.r = r;
+    stamp.val = val;
+
+    _data->addStamp(stamp, x - r, y - r, x + r, y + r, _sizeX, _sizeY);
+}
+
+void Geometry::stampRect(double fx0, double fy0, double fx1, double fy1, float val) {
+    int x0 = 0.5*(std::min(fx0, fx1) + 1.0)*_sizeX;
+    int y0 = 0.5*(std::min(fy0, fy1) + 1.0)*_sizeY;
+    int x1 = 0.5*(std::max(fx0, fx1) + 1.0)*_sizeX;
+    int y1 = 0.5*(std::max(fy0, fy1) + 1.0)*_sizeY;
+
+    CLIF::TypeStamp stamp;
+    stamp.type = STAMP_RECT;
+    stamp.x0 = x0; stamp.y0 = y0;
+    stamp.x1 = x1; stamp.y1 = y1;
+    stamp.r = 0.0f;
+    stamp.val = val;
+
+    _data->addStamp(stamp, x0, y0, x1, y1, _sizeX, _sizeY);
+}
+
+void Geometry::stampCapsule(double fx0, double fy0, double fx1, double fy1, int r, float val) {
+    int x0 = 0.5*(fx0 + 1.0)*_sizeX;
+    int y0 = 0.5*(fy0 + 1.0)*_sizeY;
+    int x1 = 0.5*(fx1 + 1.0)*_sizeX;
+    int y1 = 0.5*(fy1 + 1.0)*_sizeY;
+
+    CLIF::TypeStamp stamp;
+    stamp.type = STAMP_CAPSULE;
+    stamp.x0 = x0; stamp.y0 = y0;
+    stamp.x1 = x1; stamp.y1 = y1;
+    stamp.r = r;
+    stamp.val = val;
+
+    _data->addStamp(stamp,
+            std::min(x0, x1) - r, std::min(y0, y1) - r,
+            std::max(x0, x1) + r, std::max(y0, y1) + r, _sizeX, _sizeY);
+}
+
+void Geometry::applyStamps() {
+    auto & stamps = *_data->_stamps;
+    if (stamps.empty()) return;
+
+    cl_int nStamps = stamps.size();
+    if (nStamps > _data->_stampsCapacity) {
+        _data->_stampsCapacity = std::max(64, 2*nStamps);
+        _oclm->allocateOpenCLBuffer("stamps",
+                (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ,
+                _data->_stampsCapacity*sizeof(CLIF::TypeStamp), NULL);
+    }
+
+    _oclm->writeBuffer("stamps", CL_FALSE, nStamps*sizeof(CLIF::TypeStamp), stamps.data());
+
+    cl_int x0 = _data->_stampsX0;
+    cl_int y0 = _data->_stampsY0;
+    cl_uint nx = _sizeX;
+
+    _oclm->setKernelArgAsBuffer("applyStamps", 0, "tex_data");
+    _oclm->setKernelArgAsBuffer("applyStamps", 1, "objects");
+    _oclm->setKernelArgAsBuffer("applyStamps", 2, "stamps");
+    _oclm->setKernelArg("applyStamps", 3, sizeof(cl_int),  &nStamps);
+    _oclm->setKernelArg("applyStamps", 4, sizeof(cl_int),  &x0);
+    _oclm->setKernelArg("applyStamps", 5, sizeof(cl_int),  &y0);
+    _oclm->setKernelArg("applyStamps", 6, sizeof(cl_uint), &nx);
+
+    _oclm->acquireGLObject("tex_data");
+    _oclm->runKernel2D("applyStamps",
+            _data->_stampsX1 - _data->_stampsX0 + 1,
+            _data->_stampsY1 - _data->_stampsY0 + 1, 1, 1);
+    _oclm->releaseGLObject("tex_data");
+
+    _data->markObjectsChanged(Rect::make(
+                _data->_stampsX0, _data->_stampsY0, _data->_stampsX1, _data->_stampsY1), _sizeX, _sizeY);
+
+    stamps.clear();
+    _data->_objectsOnHost = false;
+}
+
+void Geometry::syncObjects() {
+    applyStamps();
+    if (_data->_objectsOnHost) return;
+
+    const int size = _sizeX*_sizeY*sizeof(CLIF::TypeObject);
+    if (_oclm->isHostVisible("objects")) {
+        void * ptr = _oclm->mapBuffer("objects", CL_TRUE, OCL::BaseManager::MAP_READ, 0, size);
+        std::memcpy(_data->_objects->data(), ptr, size);
+        _oclm->unmapBuffer("objects", ptr);
+    } else {
+        _oclm->readBuffer("objects", CL_TRUE, size, _data->_objects->data());
+    }
+    _data->_objectsOnHost = true;
+}
+
+int Geometry::addSpriteMask(int sizeX, int sizeY, const float * data) {
+    auto & masks = *_data->_spriteMasks;
+    auto & maskData = *_data->_spriteMaskData;
+
+    CLIF::TypeSpriteMask mask;
+    mask.offset = maskData.size();
+    mask.sizeX = sizeX;
+    mask.sizeY = sizeY;
+
+    masks.push_back(mask);
+    maskData.insert(maskData.end(), data, data + sizeX*sizeY);
+    _data->_spriteMasksChanged = true;
+
+    return masks.size() - 1;
+}
+
+void Geometry::updateSprites() {
+    auto & instances = *_data->_spriteInstances;
+
+    cl_int nInstances = instances.size();
+    if (nInstances == 0 && _data->_useObjectsFrame == false) return;
+
+    if (_data->_spriteMasksChanged) {
+        _oclm->allocateOpenCLBuffer("spriteMasks",
+                (OCL::BaseManager::CLFlags) (OCL::BaseManager::CLFlags::MEM_READ | OCL::BaseManager::CLFlags::MEM_COPY_HOST_PTR),
+                _data->_spriteMasks->size()*sizeof(CLIF::TypeSpriteMask), _data->_spriteMasks->data());
+        _oclm->allocateOpenCLBuffer("spriteMaskData",
+                (OCL::BaseManager::CLFlags) (OCL::BaseManager::CLFlags::MEM_READ | OCL::BaseManager::CLFlags::MEM_COPY_HOST_PTR),
+                _data->_spriteMaskData->size()*sizeof(cl_float), _data->_spriteMaskData->data());
+        _data->_spriteMasksChanged = false;
+    }
+
+    if (_data->_objectsFrameSize < _sizeX*_sizeY) {
+        _data->_objectsFrameSize = _sizeX*_sizeY;
+        _oclm->allocateOpenCLBuffer("objectsFrame",
+                (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ_WRITE,
+                _sizeX*_sizeY*sizeof(CLIF::TypeObject), NULL);
+    }
+
+    applyStamps();
+    _oclm->copyBuffer("objects", "objectsFrame", _sizeX*_sizeY*sizeof(CLIF::TypeObject));
+
+    if (nInstances > 0) {
+        if (nInstances > _data->_spriteInstancesCapacity) {
+            _data->_spriteInstancesCapacity = std::max(64, 2*nInstances);
+            _oclm->allocateOpenCLBuffer("spriteInstances",
+                    (OCL::BaseManager::CLFlags) OCL::BaseManager::CLFlags::MEM_READ,
+                    _data->_spriteInstancesCapacity*sizeof(CLIF::TypeSpriteInstance), NULL);
+        }
+
+        _oclm->writeBuffer("spriteInstances", CL_FALSE, nInstances*sizeof(CLIF::TypeSpriteInstance), instances.data());
+
+        cl_uint nx = _sizeX;
+        cl_uint ny = _sizeY;
+
+        _oclm->setKernelArgAsBuffer("drawSprites", 0, "objectsFrame");
+        _oclm->setKernelArgAsBuffer("drawSprites", 1, "spriteMasks");
+        _oclm->setKernelArgAsBuffer("drawSprites", 2, "spriteMaskData");
+        _oclm->setKernelArgAsBuffer("drawSprites", 3, "spriteInstances");
+        _oclm->setKernelArg("drawSprites", 4, sizeof(cl_int),  &nInstances);
+        _oclm->setKernelArg("drawSprites", 5, sizeof(cl_uint), &nx);
+        _oclm->setKernelArg("drawSprites", 6, sizeof(cl_uint), &ny);
+        _oclm->runKernel("drawSprites", nInstances, 64);
+    }
+
+    _oclm->setKernelArgAsBuffer("drawObjects", 0, "tex_data");
+    _oclm->setKernelArgAsBuffer("drawObjects", 1, "objectsFrame");
+
+    _oclm->acquireGLObject("tex_data");
+    _oclm->runKernel2D("drawObjects", _sizeX, _sizeY, 1, 1);
+    _oclm->releaseGLObject("tex_data");
+
+    // the cells covered by the instances now and in the previous frame
+    Rect rect = _data->_spritesRect;
+    _data->_spritesRect = Rect();
+    for (const auto & inst : instances) {
+        if (!(inst.sx > 0.0f && inst.sy > 0.0f)) continue;
+
+        float c = std::fabs(cos(inst.ang));
+        float s = std::fabs(sin(inst.ang));
+        float ex = c*inst.sx + s*inst.sy;
+        float ey = s*inst.sx + c*inst.sy;
+
+        _data->_spritesRect.add(Rect::make(
+                    std::max((int) (0.5f*(inst.x0 - ex + 1.0f)*_sizeX), 0),
+                    std::max((int) (0.5f*(inst.y0 - ey + 1.0f)*_sizeY), 0),
+                    std::min((int) (0.5f*(inst.x0 + ex + 1.0f)*_sizeX), _sizeX - 1),
+                    std::min((int) (0.5f*(inst.y0 + ey + 1.0f)*_sizeY), _sizeY - 1)));
+    }
+    rect.add(_data->_spritesRect);
+
+    _data->_useObjectsFrame = (nInstances > 0);
+    if (_data->hasStaticLights()) {
+        _data->_spritesChanged = true;
+        _data->_spritesDirty.add(rect.grow(1, _sizeX, _sizeY));
+    } else {
+        _data->markObjectsChanged(rect, _sizeX, _sizeY);
+    }
+}
+
+void Geometry::addSegment(float fx0, float fy0, float fx1, float fy1) {
+    CLIF::TypeSegment segment;
+    segment.x0 = fx0; segment.y0 = fy0;
+    segment.x1 = fx1; segment.y1 = fy1;
+
+    _data->_segments->push_back(segment);
+    _data->_segmentsChanged = true;
+    _data->markObjectsChanged(_sizeX, _sizeY);
+}
+
+void Geometry::addPolygon(const float * xy, int nPoints, bool closed) {
+    for (int i = 0; i + 1 < nPoints; ++i) {
+        addSegment(xy[2*i], xy[2*i + 1], xy[2*i + 2], xy[2*i + 3]);
+    }
+    if (closed && nPoints > 2) {
+        addSegment(xy[2*nPoints - 2], xy[2*nPoints - 1], xy[0], xy[1]);
+    }
+}
+
+void Geometry::clearSegments() {
+    _data->_segments->clear();
+    _data->_segmentsChanged = true;
+    _data->markObjectsChanged(_sizeX, _sizeY);
+}
+
+std::shared_ptr<Data::Objects> Geometry::getObjects() {
+    syncObjects();
+    return _data->_objects;
+}
+
 std::shared_ptr<Data::Lights> Geometry::getLights() {
     return _data->_lights;
 }
 
+std::shared_ptr<Data::SpriteInstances> Geometry::getSpriteInstances() {
+    return _data->_spriteInstances;
+}
+
 std::shared_ptr<OCL::BaseManager> Geometry::getOCLManager() {
     return _oclm;
 }
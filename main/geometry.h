@@ -9,9 +9,13 @@
 
 #include <memory>
 #include <map>
+#include <string>
+#include <vector>
 
 namespace Data {
+struct Objects;
 struct Lights;
+struct SpriteInstances;
 }
 
 namespace OCL {
@@ -26,6 +30,9 @@ public:
     void configure(const std::string & fname);
 
     void allocate(int sizeX, int sizeY);
+    // keeps the lights and the occupancy (resampled on the device) and reallocates only what
+    // the changed parameters need; the grid textures are redrawn only after a resize
+    void reconfigure(int sizeX, int sizeY, int nLights, int nLightAngles);
 
     void updateFloorTexture();
     void updateObjectsTexture();
@@ -33,24 +40,121 @@ public:
 
     void calcShadowMap();
 
+    void setLightStatic(int l, bool isStatic);
+    bool isLightStatic(int l) const;
+
+    // light animations are evaluated on the device from the animation time (0.1 per second),
+    // so only their edits are uploaded. txy holds nKeys (t, x, y) keys with t in [0, period)
+    void setLightPath(int l, float cx, float ax, float wx, float px, float cy, float ay, float wy, float py);
+    void setLightKeyframes(int l, const float * txy, int nKeys, float period);
+    void setLightVelocity(int l, float vx, float vy);
+    void clearLightAnimation(int l);
+
+    // the part of the world [-1, 1]^2 that is visible, only it is shaded. with nPixelsX > 0 the
+    // shadow map resolution follows the number of screen pixels across the view
+    void setViewRect(float fx0, float fy0, float fx1, float fy1, int nPixelsX = 0);
+    // view coordinates in [-1, 1]^2 to world coordinates
+    void viewToWorld(float & fx, float & fy) const;
+
+    // reallocate only the buffers that depend on the angle count / shadow map resolution
+    void setLightAngles(int nLightAngles);
+    void setShadowMapScale(int scale);
+
     void finishOpenCL();
 
+    // measures the row kernel configurations before the first frame, see _autotune
+    void autotune();
+
     void renderScene();
     void renderShadowMap();
 
     void addObjectCircle(double fx, double fy, int r, float val);
     void clear();
 
+    void stampCircle(double fx, double fy, int r, float val);
+    void stampRect(double fx0, double fy0, double fx1, double fy1, float val);
+    void stampCapsule(double fx0, double fy0, double fx1, double fy1, int r, float val);
+    void applyStamps();
+
+    void syncObjects();
+
+    int addSpriteMask(int sizeX, int sizeY, const float * data);
+    void updateSprites();
+
+    void addSegment(float fx0, float fy0, float fx1, float fy1);
+    void addPolygon(const float * xy, int nPoints, bool closed = true);
+    void clearSegments();
+
+    std::shared_ptr<Data::Objects> getObjects();
     std::shared_ptr<Data::Lights> getLights();
+    std::shared_ptr<Data::SpriteInstances> getSpriteInstances();
     std::shared_ptr<OCL::BaseManager> getOCLManager();
 
+    bool isIdle() const { return _isIdle; }
+
     int _sizeX = -1;
     int _sizeY = -1;
 
     int _nLights = 8;
     int _nLightAngles = 512;
 
+    bool _animateLights = true;
+
+    // max light rows refreshed per frame for moved lights, 0 - no limit
+    int _lightRowBudget = 0;
+    // time budget for the refreshed rows in seconds, 0 - no limit
+    float _lightTimeBudget = 0.0f;
+
+    // shadow map size is the grid size divided by this
+    int _shadowMapScale = 4;
+    // soft shadows average 2*_softSize + 1 angular bins
+    int _softSize = 2;
+
+    // target time for calcShadowMap in seconds - angle count, shadow map resolution and
+    // soft shadow taps are adapted to hold it. 0 - fixed quality
+    float _targetFrameTime = 0.0f;
+
+    // shade a checkerboard half of the shadow map per frame with jittered angular bins and
+    // accumulate into a history - allows lower nLightAngles for slowly changing scenes
+    bool _temporal = false;
+
+    // upsample the shadow map to the grid resolution guided by the occupancy, and re-shade
+    // at full resolution where the low resolution values vary by more than _refineThreshold
+    bool _upsample = false;
+    bool _refineEdges = true;
+    float _refineThreshold = 0.1f;
+
+    // measure the workgroup configurations and variants of the row kernel at startup. the frames
+    // only pick from the results, which are cached per device across runs
+    bool _autotune = true;
+
 private:
+    float _viewX0 = -1.0f;
+    float _viewY0 = -1.0f;
+    float _viewX1 = 1.0f;
+    float _viewY1 = 1.0f;
+
+    struct Rect;
+
+    void calcLightRows(const std::string & distance, const std::string & objects, const Rect & wedgesRect);
+    void mergeLightWedges(const std::string & distance, const std::string & objects, const Rect & rect);
+    void shadeLights(const std::vector<int> & lightIds, bool useBase, const Rect & rect);
+
+    void uploadLights(const std::vector<int> & scheduled);
+    void updateViewRect();
+
+    void allocateLights();
+    void allocateGridTextures();
+    void drawObjectsTexture();
+    void resampleObjects(int sizeX, int sizeY);
+
+    void allocateLightDistance();
+    void allocateShadowMap();
+    void upsampleShadowMap();
+    void updateQuality(float frameTime);
+
+    bool _isIdle = false;
+
     CG::Timer _timer;
 
     std::shared_ptr<OCL::BaseManager> _oclm;
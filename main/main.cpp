@@ -9,6 +9,7 @@
 #include "cg_window2d.h"
 
 #include "cg_opencl/oclCommon.h"
+#include "cg_opencl/oclBaseManager.h"
 #include "cg_opencl/oclProfiler.h"
 
 #include "app.h"
@@ -26,14 +27,28 @@ int main(int argc, char **argv) {
     OCL_PROFILING_SET_PARAMETERS("kernel_ALL", "", 1, 0)
     OCL_PROFILING_SET_PARAMETERS("kernel_drawFloor", "", 1, 0)
     OCL_PROFILING_SET_PARAMETERS("kernel_drawObjects", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("kernel_applyStamps", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("kernel_resampleObjects", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("kernel_drawSprites", "", 1, 0)
     OCL_PROFILING_SET_PARAMETERS("kernel_calcDistance", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("kernel_resetLightDistance", "", 1, 0)
     OCL_PROFILING_SET_PARAMETERS("kernel_calcDistance2", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("kernel_calcDistance2Pairs", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("kernel_resetLightDistanceWedges", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("kernel_calcDistanceWedges", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("kernel_copyLightDistance", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("kernel_accumulateShadow", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("kernel_calcDistanceSegments", "", 1, 0)
     OCL_PROFILING_SET_PARAMETERS("kernel_calcShadowMap", "", 1, 0)
     OCL_PROFILING_SET_PARAMETERS("kernel_calcShadowMap2", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("kernel_upsampleShadow", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("kernel_animateLights", "", 1, 0)
 
     OCL_PROFILING_SET_PARAMETERS("oclBuffer_read_ALL", "", 1, 0)
     OCL_PROFILING_SET_PARAMETERS("oclBuffer_write_ALL", "", 1, 0)
     OCL_PROFILING_SET_PARAMETERS("oclBuffer_write_lights", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("oclBuffer_map_ALL", "", 1, 0)
+    OCL_PROFILING_SET_PARAMETERS("oclBuffer_unmap_ALL", "", 1, 0)
     OCL_PROFILING_SET_PARAMETERS("oclBuffer_fillFloat_ALL", "", 1, 0)
 
     int nFrames = 0;
@@ -54,10 +69,16 @@ int main(int argc, char **argv) {
         app.getGeometry()->allocate(1024, 1024);
         app.getGeometry()->updateFloorTexture();
         app.getGeometry()->updateObjectsTexture();
+        app.getGeometry()->autotune();
         app.getGeometry()->finishOpenCL();
 
         while (true) {
-            app.pollEvents();
+            // nothing changed in the last frame - sleep until the user does something
+            if (app.getGeometry()->isIdle()) {
+                app.waitEvents();
+            } else {
+                app.pollEvents();
+            }
             app.processKeyboard();
             app.updateState();
             if (app.shouldTerminate()) break;
@@ -69,9 +90,14 @@ int main(int argc, char **argv) {
 
             app.getWindow()->render();
 
-            app.getGeometry()->updateLights();
-            app.getGeometry()->calcShadowMap();
-            app.getGeometry()->finishOpenCL();
+            {
+                // the OpenCL work of the frame is flushed and finished once at the end of the scope
+                OCL::BaseManager::SubmissionScope submission(*app.getGeometry()->getOCLManager());
+
+                app.updateSprites();
+                app.getGeometry()->updateLights();
+                app.getGeometry()->calcShadowMap();
+            }
 
             if (!app.getUI()->_isFullscreen) app.getWindow()->applyViewport(0);
             app.getGeometry()->renderScene();
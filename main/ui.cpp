@@ -14,6 +14,8 @@
 #include "imgui/imgui.h"
 #include "imgui/examples/opengl2_example/imgui_impl_glfw.h"
 
+#include <cmath>
+
 void UI::init(std::shared_ptr<CG::Window2D> window, bool setCallbacks) {
     ImGui_ImplGlfw_Init(window->getGLFWWindow(), setCallbacks);
 }
@@ -71,6 +73,19 @@ void UI::renderWindowControls() {
     if (ImGui::SliderInt("Gridsize Y", &_geometrySizeY, 128, 4096)) { _geometrySizeX = _geometrySizeY; }
     ImGui::SliderInt("Lights", &_nLights, 0, 32);
     ImGui::SliderInt("Light angles", &_nLightAngles, 16, 2048);
+    ImGui::Checkbox("Animate lights", &_animateLights);
+    ImGui::SliderInt("Static lights", &_nStaticLights, 0, 32);
+    ImGui::SliderInt("Light rows per frame", &_lightRowBudget, 0, 32);
+    ImGui::SliderFloat("Target shadow time [ms]", &_targetFrameTimeMs, 0.0f, 33.0f);
+    ImGui::Checkbox("Temporal shadows", &_temporal);
+    ImGui::SliderInt("Shadow map scale", &_shadowMapScale, 1, 8);
+    ImGui::Checkbox("Upsample shadows", &_upsample);
+    ImGui::SliderFloat("Zoom", &_viewZoom, 1.0f, 8.0f);
+    ImGui::SliderFloat("View X", &_viewX, -1.0f, 1.0f);
+    ImGui::SliderFloat("View Y", &_viewY, -1.0f, 1.0f);
+    ImGui::Checkbox("Shadow resolution from view", &_autoShadowMapScale);
+    ImGui::SliderInt("Moving occluders", &_nSprites, 0, 256);
+    ImGui::Checkbox("Polygons", &_showPolygons);
     if (ImGui::Button("Update")) { _updateGeometry = true; } ImGui::SameLine();
     if (ImGui::Button("Clear")) { _clearGeometry = true; }
 
@@ -119,4 +134,14 @@ void UI::renderWindowKernelEdit() {
 void UI::renderLightProperties(Data::Light & light) {
     ImGui::Text("Pos: %.4f %.4f", light.x0, light.y0);
     ImGui::SliderFloat("Intensity", &light.intensity, 0.0f, 1.0f);
+
+    // a full 360 degree cone is an omni light
+    ImGui::SliderAngle("Cone", &light.ang, 1.0f, 360.0f);
+    if (light.ang < 6.28f) {
+        float dirAng = std::atan2(light.dir.s[1], light.dir.s[0]);
+        if (ImGui::SliderAngle("Direction", &dirAng, -180.0f, 180.0f)) {
+            light.dir.s[0] = std::cos(dirAng);
+            light.dir.s[1] = std::sin(dirAng);
+        }
+    }
 }
@@ -30,6 +30,8 @@ public:
     void setLights(std::shared_ptr<Data::Lights> lights);
     void setOCLManager(std::shared_ptr<OCL::BaseManager> oclm);
 
+    float getViewportWidth() const { return _viewportDx; }
+
     bool _updateGeometry = false;
     bool _clearGeometry = false;
     bool _isFullscreen = false;
@@ -40,6 +42,20 @@ public:
     int _nLights = -1;
     int _nLightAngles = -1;
 
+    int _nSprites = 0;
+    int _nStaticLights = 0;
+    int _lightRowBudget = 0;
+    float _targetFrameTimeMs = 0.0f;
+    bool _temporal = false;
+    bool _upsample = false;
+    int _shadowMapScale = 4;
+    bool _autoShadowMapScale = false;
+    float _viewZoom = 1.0f;
+    float _viewX = 0.0f;
+    float _viewY = 0.0f;
+    bool _animateLights = true;
+    bool _showPolygons = false;
+
 private:
     const float _windowHeader = 20.0f;
 
@@ -6,6 +6,7 @@
 #include "cg_opencl/oclConstants.h"
 #include "cg_opencl/oclBaseManager.h"
 #include "cg_opencl/oclProfiler.h"
+#include "cg_opencl/oclEmbeddedKernels.h"
 
 #include "cg_logger.h"
 #include "cg_timer.h"
@@ -23,8 +24,28 @@
 #include <OpenGL/gl.h>
 #endif
 
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <deque>
+#include <set>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
 constexpr auto kLogTag = OCL::Constants::LogTags::kBaseManager;
 
+// buffers up to kArenaMaxSize are sub-buffers of kSlabSize slabs
+constexpr size_t kArenaMaxSize = 256*1024;
+constexpr size_t kSlabSize     = 8*1024*1024;
+constexpr size_t kPoolMaxBytes = 256*1024*1024;
+
 namespace {
 std::string uppercase(const std::string &s) {
     std::string res(s);
@@ -33,12 +54,77 @@ std::string uppercase(const std::string &s) {
     }
     return res;
 }
+
+uint64_t fnv1a(const std::string &s) {
+    uint64_t res = 14695981039346656037ull;
+    for (size_t i = 0; i < s.length(); ++i) {
+        res ^= (unsigned char) s[i];
+        res *= 1099511628211ull;
+    }
+    return res;
+}
+
+bool readFile(const std::string &fname, std::string &content) {
+    std::ifstream fin(fname, std::ios::binary);
+    if (fin.good() == false) return false;
+    std::stringstream ss;
+    ss << fin.rdbuf();
+    content = ss.str();
+    return true;
+}
+
+bool fileExists(const std::string &fname) {
+    struct stat st;
+    return stat(fname.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+std::string directoryOf(const std::string &fname) {
+    auto p = fname.find_last_of('/');
+    return (p == std::string::npos) ? std::string("./") : fname.substr(0, p + 1);
+}
+
+std::string baseNameOf(const std::string &fname) {
+    auto p = fname.find_last_of('/');
+    return (p == std::string::npos) ? fname : fname.substr(p + 1);
+}
+
+void CL_CALLBACK freeHostStorage(cl_mem, void *ptr) {
+    free(ptr);
+}
+
+// per-user cache location, empty if the environment has none
+std::string userCacheDir() {
+    const char * xdg = std::getenv("XDG_CACHE_HOME");
+    if (xdg && xdg[0]) return std::string(xdg) + "/ocl-lights/";
+    const char * home = std::getenv("HOME");
+    if (home && home[0]) return std::string(home) + "/.cache/ocl-lights/";
+    return "";
+}
+
+void makeDirectories(const std::string &path) {
+    for (size_t p = path.find('/', 1); ; p = path.find('/', p + 1)) {
+        mkdir(path.substr(0, p).c_str(), 0755);
+        if (p == std::string::npos) break;
+    }
+}
 }
 
 namespace OCL {
 
 struct BaseManager::Buffer {
     cl_mem V = 0;
+    int generation = 0; // incremented whenever V changes
+
+    // set for buffers from allocateOpenCLBuffer, V goes back to the pool or the arena when released
+    bool pooled = false;
+    cl_mem_flags flags = 0;
+    size_t capacity = 0;
+
+    int slab = -1;      // arena slab V is a sub-buffer of
+    size_t offset = 0;
+
+    // page-aligned storage of a zero-copy buffer, freed once the runtime destroys V
+    void * host = nullptr;
 };
 
 struct BaseManager::Device : public BaseManager::IDevice {
@@ -47,12 +133,15 @@ struct BaseManager::Device : public BaseManager::IDevice {
 
     virtual int getComputeUnits() const override { return computeUnits; }
 
-    std::string name       = std::string("noname");
-    std::string vendorName = std::string("noname");
+    std::string name          = std::string("noname");
+    std::string vendorName    = std::string("noname");
+    std::string driverVersion = std::string("unknown");
 
     cl_uint computeUnits = 4;
     size_t maxWorkgroup  = 256;
 
+    cl_bool hostUnifiedMemory = CL_FALSE;
+
     cl_platform_id platformID = 0;
     cl_device_id   deviceID   = 0;
 
@@ -60,6 +149,14 @@ struct BaseManager::Device : public BaseManager::IDevice {
     unsigned int optimumWorkgroupSize  = 16;
 };
 
+// last value set for a kernel argument - either a buffer or the raw bytes
+struct BaseManager::KernelArg {
+    const Buffer * buffer = nullptr;
+    int generation = 0;
+    size_t size = 0;
+    std::vector<char> value;
+};
+
 struct BaseManager::Kernel : public BaseManager::IKernel {
     Kernel() {}
     virtual ~Kernel() override {}
@@ -80,6 +177,17 @@ struct BaseManager::Kernel : public BaseManager::IKernel {
 
     cl_ulong privateMemUsed = 0;
     cl_ulong localMemUsed   = 0;
+
+    std::string name;
+    std::string profileId;
+
+    std::vector<KernelArg> args;
+
+    // variant picked by the autotuner, it receives the arguments and runs in place of this kernel
+    Kernel * active = nullptr;
+    int tunedProblemSize = -1;
+
+    Kernel & target() { return active ? *active : *this; }
 };
 
 struct BaseManager::KernelContainer : public std::map<std::string, BaseManager::Kernel> {};
@@ -87,12 +195,21 @@ struct BaseManager::BufferContainer : public std::map<std::string, BaseManager::
 
 struct BaseManager::BuildConfiguration {
     bool                               recompile;
+    std::string                        cacheDir;
+    std::vector<std::string>           includeDirs;     // relative to the kernel path
     std::string                        buildArguments;
     std::map<std::string, std::string> buildArgumentsForVendor;
 };
 
 struct BaseManager::OpenCLSupport {
     bool clEnqueueFillBuffer = false;
+
+    // CL_DEVICE_MEM_BASE_ADDR_ALIGN in bytes, sub-buffer origins must be a multiple of it
+    size_t subBufferAlignment = 4096;
+
+    // cl_khr_il_program, needed to build the SPIR-V embedded in the library
+    typedef cl_program (CL_API_CALL *CreateProgramWithIL)(cl_context, const void *, size_t, cl_int *);
+    CreateProgramWithIL clCreateProgramWithIL = nullptr;
 };
 
 struct BaseManager::Data {
@@ -107,122 +224,244 @@ struct BaseManager::Data {
         return res;
     }
 
-    void compileOrLoadProgram(
-            const char* fname,
-            cl_program &program,
-            cl_context &context,
-            cl_device_id &device) {
-        cl_int ret;
+    std::string buildLog(cl_program program, cl_device_id device) const {
+        size_t len = 0;
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
+        std::vector<char> buffer(len + 1, 0);
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, len, buffer.data(), NULL);
+        return std::string(buffer.data());
+    }
 
-        std::string args("-I "); args += _kernelPath; args += " ";
-        args += _buildConfiguration.buildArguments;
-        for (std::map<std::string, std::string>::iterator it =  _buildConfiguration.buildArgumentsForVendor.begin();
-                it != _buildConfiguration.buildArgumentsForVendor.end(); ++it) {
-            if (uppercase(getSelectedDevice().vendorName).find(uppercase(it->first)) != std::string::npos) {
-                args += it->second;
+    // contents of the program followed by every header it pulls in with #include "...",
+    // looked up next to the including file first and then in the -I directories
+    void appendIncludeClosure(
+            const std::string & fname,
+            const std::vector<std::string> & includeDirs,
+            std::set<std::string> & visited,
+            std::string & closure) const {
+        if (visited.insert(fname).second == false) return;
+
+        std::string source;
+        if (readFile(fname, source) == false) return;
+        closure += source;
+        closure += '\0';
+
+        std::stringstream ss(source);
+        std::string line;
+        while (std::getline(ss, line)) {
+            auto p = line.find_first_not_of(" \t");
+            if (p == std::string::npos || line.compare(p, 8, "#include") != 0) continue;
+            auto q0 = line.find('"', p + 8);
+            if (q0 == std::string::npos) continue;
+            auto q1 = line.find('"', q0 + 1);
+            if (q1 == std::string::npos) continue;
+            std::string header = line.substr(q0 + 1, q1 - q0 - 1);
+
+            std::vector<std::string> candidates(1, directoryOf(fname) + header);
+            for (const auto & dir : includeDirs) candidates.push_back(dir + "/" + header);
+            for (const auto & candidate : candidates) {
+                if (fileExists(candidate) == false) continue;
+                closure += header;
+                closure += '\0';
+                appendIncludeClosure(candidate, includeDirs, visited, closure);
+                break;
             }
         }
+    }
 
-        std::string fnameBin(fname); fnameBin += ".bin";
-        FILE *fpbin = fopen(fnameBin.c_str(), "rb");
-        if (fpbin == NULL || _buildConfiguration.recompile) {
-            char *source_str;
-            size_t source_size;
-            source_str = new char[1000000];
+    std::string sourceClosure(const std::string & fname, const std::string & args) const {
+        std::vector<std::string> includeDirs;
+        {
+            std::stringstream ss(args);
+            std::string token;
+            while (ss >> token) {
+                if (token == "-I") {
+                    if (ss >> token) includeDirs.push_back(token);
+                } else if (token.compare(0, 2, "-I") == 0) {
+                    includeDirs.push_back(token.substr(2));
+                }
+            }
+        }
 
-            FILE *fp = fopen(fname, "r");
-            if (!fp) throw Exception("[OCLM] Failed to open file '%s'.", fname);
+        std::set<std::string> visited;
+        std::string closure;
+        appendIncludeClosure(fname, includeDirs, visited, closure);
 
-            source_size = fread(source_str, 1, 1000000, fp);
-            fclose(fp);
+        return closure;
+    }
 
-            program = clCreateProgramWithSource(context, 1, (const char **)&source_str, (const size_t *)&source_size, &ret);
-            if (ret != CL_SUCCESS || !program) {
-                throw Exception("[OCLM] Unable to create OpenCL program from source. (ret = %d)", ret);
-            }
+    // the binary is valid only for the exact sources, build options and driver it was built with
+    std::string programCacheFile(const std::string & fname, const std::string & sources, const std::string & args) const {
+        const auto & device = getSelectedDevice();
+        std::string key(sources);
+        key += args; key += '\0';
+        key += device.name; key += '\0';
+        key += device.driverVersion;
 
-            delete [] source_str;
+        char hash[17];
+        snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) fnv1a(key));
 
-            ret = clBuildProgram(program, 1, &device, args.c_str(), NULL, NULL);
+        return _buildConfiguration.cacheDir + baseNameOf(fname) + "-" + hash + ".bin";
+    }
 
-            {
-                size_t len;
-                clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
-                std::vector<char> buffer(len, 0);
-                clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, len, buffer.data(), &len);
-                std::string log(buffer.data());
-                if (ret != CL_SUCCESS) {
-                    throw Exception("[OCLM] %d %s\n[OCLM] Failed to build OpenCL program. (ret = %d)", len, log.c_str(), ret);
-                }
-                CG_INFOC(10, "\n%s\n\n", log.c_str());
-            }
+    bool loadProgramBinary(
+            const std::string & fnameBin,
+            const std::string & args,
+            cl_program &program,
+            cl_context &context,
+            cl_device_id &device) const {
+        std::string binary;
+        if (readFile(fnameBin, binary) == false || binary.empty()) return false;
+
+        cl_int ret;
+        cl_int binaryStatus;
+        size_t binarySize = binary.size();
+        const unsigned char * programBinary = (const unsigned char *) binary.data();
+        program = clCreateProgramWithBinary(context, 1, &device, &binarySize, &programBinary, &binaryStatus, &ret);
+        if (ret != CL_SUCCESS || binaryStatus != CL_SUCCESS || !program) {
+            CG_IDBG(10, kLogTag, "Rejected cached binary '%s'. (ret = %d, status = %d)\n", fnameBin.c_str(), ret, binaryStatus);
+            if (program) clReleaseProgram(program);
+            return false;
+        }
 
-            cl_uint nDevices = 0;
-            ret = clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &nDevices, NULL);
+        ret = clBuildProgram(program, 1, &device, args.c_str(), NULL, NULL);
+        if (ret != CL_SUCCESS) {
+            CG_IDBG(10, kLogTag, "Failed to build cached binary '%s'. (ret = %d)\n%s\n", fnameBin.c_str(), ret, buildLog(program, device).c_str());
+            clReleaseProgram(program);
+            return false;
+        }
 
-            if (nDevices == 1) {
-                std::vector<size_t> programBinarySizes(nDevices);
-                ret = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * nDevices, programBinarySizes.data(), NULL);
-                if (ret != CL_SUCCESS) {
-                    throw Exception("[OCLM] Unable to query program binary size. (ret = %d)", ret);
-                }
+        return true;
+    }
 
-                std::vector<std::vector<unsigned char>> programBinaries(1);
-                for (cl_uint i = 0; i < 1; i++) {
-                    programBinaries[i].resize(programBinarySizes[i]);
-                }
+    bool buildProgramFromIL(
+            const EmbeddedKernels::Program & embedded,
+            const std::string & args,
+            cl_program &program,
+            cl_context &context,
+            cl_device_id &device,
+            std::string &log) const {
+        cl_int ret;
+        program = _support.clCreateProgramWithIL(context, embedded.il, embedded.ilSize, &ret);
+        if (ret != CL_SUCCESS || !program) {
+            CG_IDBG(10, kLogTag, "Unable to create program from SPIR-V. (ret = %d)\n", ret);
+            return false;
+        }
 
-                ret = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*) * 1, programBinaries.data(), NULL);
-                if (ret != CL_SUCCESS) {
-                    throw Exception("[OCLM] Unable to query program binaries. (ret = %d)", ret);
-                }
+        ret = clBuildProgram(program, 1, &device, args.c_str(), NULL, NULL);
+        log = buildLog(program, device);
+        if (ret != CL_SUCCESS) {
+            CG_IDBG(10, kLogTag, "Failed to build program from SPIR-V. (ret = %d)\n%s\n", ret, log.c_str());
+            clReleaseProgram(program);
+            program = 0;
+            return false;
+        }
 
-                FILE *fpsave = fopen(fnameBin.c_str(), "wb");
-                fwrite(programBinaries[0].data(), 1, programBinarySizes[0], fpsave);
-                fclose(fpsave);
-            }
-        } else {
-            size_t binarySize;
-            fseek(fpbin, 0, SEEK_END);
-            binarySize = ftell(fpbin);
-            rewind(fpbin);
-
-            unsigned char *programBinary = new unsigned char[binarySize];
-            size_t res = fread(programBinary, 1, binarySize, fpbin);
-            fclose(fpbin);
-
-            if (res != binarySize) {
-                delete [] programBinary;
-                throw Exception("[OCLM] Error while reading kernel binary file '%s'. (res = %ld)", fnameBin.c_str(), res);
+        return true;
+    }
+
+    void saveProgramBinary(const std::string & fnameBin, cl_program program) const {
+        cl_uint nDevices = 0;
+        cl_int ret = clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &nDevices, NULL);
+        if (ret != CL_SUCCESS || nDevices != 1) return;
+
+        size_t binarySize = 0;
+        ret = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL);
+        if (ret != CL_SUCCESS || binarySize == 0) return;
+
+        std::vector<unsigned char> binary(binarySize);
+        unsigned char * programBinary = binary.data();
+        ret = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), &programBinary, NULL);
+        if (ret != CL_SUCCESS) {
+            CG_IDBG(10, kLogTag, "Unable to query program binaries. (ret = %d)\n", ret);
+            return;
+        }
+
+        // write to a temporary file first so that a concurrent start never reads half a binary
+        makeDirectories(_buildConfiguration.cacheDir);
+        std::string fnameTmp = fnameBin + ".tmp";
+        {
+            std::ofstream fout(fnameTmp, std::ios::binary);
+            fout.write((const char *) binary.data(), binary.size());
+            if (fout.good() == false) {
+                CG_IDBG(10, kLogTag, "Unable to write program binary '%s'\n", fnameTmp.c_str());
+                return;
             }
+        }
+        if (std::rename(fnameTmp.c_str(), fnameBin.c_str()) != 0) std::remove(fnameTmp.c_str());
+    }
 
-            cl_int binaryStatus;
-            program = clCreateProgramWithBinary(context, 1, &device, &binarySize, (const unsigned char**)&programBinary, &binaryStatus, &ret);
+    // safe to call from several threads at once, returns true if the program came from the cache.
+    // name is relative to the kernel path. sources embedded in the library are used instead of the
+    // files on disk
+    bool compileOrLoadProgram(
+            const std::string & name,
+            cl_program &program,
+            cl_context &context,
+            cl_device_id &device,
+            std::string &log) const {
+        cl_int ret;
 
-            delete [] programBinary;
-            if (ret != CL_SUCCESS) {
-                throw Exception("[OCLM] Unable to create program with binary from '%s'. (ret = %d)", fnameBin.c_str(), ret);
+        const std::string fname = _kernelPath + name;
+        const EmbeddedKernels::Program * embedded = EmbeddedKernels::find(name);
+
+        // the embedded sources have their includes inlined already
+        std::string args;
+        if (embedded == nullptr) {
+            for (const auto & dir : _buildConfiguration.includeDirs) {
+                args += "-I "; args += _kernelPath; args += dir; args += " ";
+            }
+        }
+        args += _buildConfiguration.buildArguments;
+        for (std::map<std::string, std::string>::const_iterator it =  _buildConfiguration.buildArgumentsForVendor.begin();
+                it != _buildConfiguration.buildArgumentsForVendor.end(); ++it) {
+            if (uppercase(getSelectedDevice().vendorName).find(uppercase(it->first)) != std::string::npos) {
+                args += it->second;
             }
+        }
 
-            if (binaryStatus != CL_SUCCESS) {
-                throw Exception("[OCLM] Invalid binary for device. (ret = %d)", binaryStatus);
+        bool useCache = _buildConfiguration.cacheDir.empty() == false;
+        std::string fnameBin;
+        if (useCache) {
+            std::string sources = embedded ?
+                std::string(embedded->source, embedded->sourceSize) : sourceClosure(fname, args);
+            fnameBin = programCacheFile(fname, sources, args);
+            if (_buildConfiguration.recompile == false &&
+                loadProgramBinary(fnameBin, args, program, context, device)) {
+                return true;
             }
+        }
 
-            ret = clBuildProgram(program, 0, NULL, args.c_str(), NULL, NULL);
+        if (embedded && embedded->il && _support.clCreateProgramWithIL &&
+            buildProgramFromIL(*embedded, args, program, context, device, log)) {
+            if (useCache) saveProgramBinary(fnameBin, program);
+            return false;
+        }
 
-            {
-                size_t len;
-                clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
-                std::vector<char>buffer(len);
-                clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, len, buffer.data(), &len);
-                std::string log(buffer.data());
-                if (ret != CL_SUCCESS) {
-                    throw Exception("[OCLM] %d %s\n[OCLM] Failed to build OpenCL program executable. (ret = %d)", len, log.c_str(), ret);
-                }
-                CG_INFOC(10, "\n%s\n\n", log.c_str());
-            }
+        std::string source;
+        if (embedded) {
+            source.assign(embedded->source, embedded->sourceSize);
+        } else if (readFile(fname, source) == false) {
+            throw Exception("[OCLM] Failed to open file '%s'.", fname.c_str());
+        }
 
+        const char * source_str = source.c_str();
+        size_t source_size = source.size();
+        program = clCreateProgramWithSource(context, 1, &source_str, &source_size, &ret);
+        if (ret != CL_SUCCESS || !program) {
+            throw Exception("[OCLM] Unable to create OpenCL program from source. (ret = %d)", ret);
         }
+
+        ret = clBuildProgram(program, 1, &device, args.c_str(), NULL, NULL);
+
+        log = buildLog(program, device);
+        if (ret != CL_SUCCESS) {
+            throw Exception("[OCLM] %s\n[OCLM] Failed to build OpenCL program '%s'. (ret = %d)", log.c_str(), fname.c_str(), ret);
+        }
+
+        if (useCache) saveProgramBinary(fnameBin, program);
+
+        return false;
     }
 
     std::vector<Device> & getDevices() {
@@ -245,10 +484,478 @@ struct BaseManager::Data {
         return _kernels.at(kname).K;
     }
 
+    Kernel & getKernel(const std::string & kname) {
+        auto & kernel = _kernels[kname];
+        if (kernel.name.empty()) {
+            kernel.name = kname;
+            kernel.profileId = "kernel_" + kname;
+        }
+        return kernel;
+    }
+
+    void setArg(Kernel & kernel, int aid, size_t asize, const void * a) {
+        if (aid >= (int) kernel.args.size()) kernel.args.resize(aid + 1);
+        auto & arg = kernel.args[aid];
+
+        // local memory arguments have no value to compare
+        const char * bytes = (const char *) a;
+        if (a && arg.buffer == nullptr && arg.value.size() == asize &&
+            std::memcmp(arg.value.data(), bytes, asize) == 0) return;
+
+        cl_int ret = clSetKernelArg(kernel.target().K, aid, asize, a);
+        if (ret != CL_SUCCESS) {
+            throw Exception("Unable to set kernel argument %d for kernel '%s'. ret = %d",
+                            aid, kernel.name.c_str(), ret);
+        }
+
+        arg.buffer = nullptr;
+        arg.size = asize;
+        if (a) {
+            arg.value.assign(bytes, bytes + asize);
+        } else {
+            arg.value.clear();
+        }
+    }
+
+    void setArg(Kernel & kernel, int aid, const Buffer & buffer) {
+        if (aid >= (int) kernel.args.size()) kernel.args.resize(aid + 1);
+        auto & arg = kernel.args[aid];
+
+        if (arg.buffer == &buffer && arg.generation == buffer.generation) return;
+
+        cl_int ret = clSetKernelArg(kernel.target().K, aid, sizeof(cl_mem), &buffer.V);
+        if (ret != CL_SUCCESS) {
+            throw Exception("Unable to set kernel argument %d for kernel '%s'. ret = %d",
+                            aid, kernel.name.c_str(), ret);
+        }
+
+        arg.buffer = &buffer;
+        arg.generation = buffer.generation;
+        arg.value.clear();
+    }
+
+    // passes all recorded arguments of the kernel to its current target
+    void replayArgs(Kernel & kernel) {
+        auto & target = kernel.target();
+        for (int aid = 0; aid < (int) kernel.args.size(); ++aid) {
+            auto & arg = kernel.args[aid];
+            cl_int ret = CL_SUCCESS;
+            if (arg.buffer) {
+                ret = clSetKernelArg(target.K, aid, sizeof(cl_mem), &arg.buffer->V);
+                arg.generation = arg.buffer->generation;
+            } else if (arg.value.empty() == false) {
+                ret = clSetKernelArg(target.K, aid, arg.value.size(), arg.value.data());
+            } else if (arg.size > 0) {
+                ret = clSetKernelArg(target.K, aid, arg.size, NULL);
+            }
+            if (ret != CL_SUCCESS) {
+                throw Exception("Unable to set kernel argument %d for kernel '%s'. ret = %d",
+                                aid, target.name.c_str(), ret);
+            }
+        }
+    }
+
+    struct Tuning {
+        std::string variant;
+        size_t workgroups = 0;
+        size_t workgroupSize = 0;
+    };
+
+    std::string tuningKey(const std::string & kname, const std::string & workload, int problemSize) const {
+        const auto & device = getSelectedDevice();
+        return kname + "\t" + workload + "\t" + std::to_string(problemSize) + "\t" + device.name + "\t" + device.driverVersion;
+    }
+
+    // next to the program binaries unless set explicitly, empty keeps the results in memory only
+    std::string tuningCacheFile() const {
+        if (_tuningCacheFile.empty() == false) return _tuningCacheFile;
+        if (_buildConfiguration.cacheDir.empty()) return "";
+        return _buildConfiguration.cacheDir + "autotune.cache";
+    }
+
+    // one line per result: kernel, workload, problem size, device, driver, variant, workgroups,
+    // workgroup size. lines in any other format are dropped
+    void loadTuningCache() {
+        if (_tuningCacheLoaded) return;
+        _tuningCacheLoaded = true;
+
+        const std::string fname = tuningCacheFile();
+        if (fname.empty()) return;
+
+        std::ifstream fin(fname);
+        std::string line;
+        while (std::getline(fin, line)) {
+            std::vector<std::string> fields;
+            std::stringstream ss(line);
+            std::string field;
+            while (std::getline(ss, field, '\t')) fields.push_back(field);
+            if (fields.size() != 8) continue;
+
+            Tuning tuning;
+            tuning.variant = fields[5];
+            tuning.workgroups = std::stoul(fields[6]);
+            tuning.workgroupSize = std::stoul(fields[7]);
+            _tuningCache[fields[0] + "\t" + fields[1] + "\t" + fields[2] + "\t" + fields[3] + "\t" + fields[4]] = tuning;
+        }
+    }
+
+    void saveTuningCache() const {
+        const std::string fname = tuningCacheFile();
+        if (fname.empty()) return;
+
+        makeDirectories(directoryOf(fname));
+        std::ofstream fout(fname);
+        if (fout.good() == false) {
+            CG_IDBG(10, kLogTag, "Unable to write the tuning cache '%s'\n", fname.c_str());
+            return;
+        }
+        for (const auto & entry : _tuningCache) {
+            fout << entry.first << "\t" << entry.second.variant << "\t" <<
+                entry.second.workgroups << "\t" << entry.second.workgroupSize << "\n";
+        }
+    }
+
+    // average device time of one run from the profiling timestamps, negative if the
+    // configuration cannot be run
+    float timeKernel(cl_kernel K, size_t workgroups, size_t workgroupSize, int nRuns) {
+        size_t local_item_size  = workgroupSize;
+        size_t global_item_size = workgroups*workgroupSize;
+
+        clFinish(_oclQueue);
+        double total = 0.0;
+        for (int r = 0; r < nRuns; ++r) {
+            cl_event event = 0;
+            cl_int ret = clEnqueueNDRangeKernel(
+                    _oclQueue, K, 1, NULL, &global_item_size, &local_item_size, 0, NULL, &event);
+            if (ret != CL_SUCCESS) return -1.0f;
+
+            cl_ulong tStart = 0, tEnd = 0;
+            ret = clWaitForEvents(1, &event);
+            ret |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &tStart, NULL);
+            ret |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &tEnd, NULL);
+            clReleaseEvent(event);
+            if (ret != CL_SUCCESS || tEnd < tStart) return -1.0f;
+
+            total += 1e-9*(tEnd - tStart);
+        }
+        return total/nRuns;
+    }
+
+    // the kernel itself followed by its loaded variants
+    std::vector<Kernel *> variantsOf(Kernel & k) {
+        std::vector<Kernel *> res(1, &k);
+        for (const auto & vid : _kernelVariants[k.name]) {
+            auto it = _kernels.find(vid);
+            if (it != _kernels.end() && it->second.K) res.push_back(&it->second);
+        }
+        return res;
+    }
+
+    void applyVariant(Kernel & k, Kernel * variant, size_t workgroups, size_t workgroupSize) {
+        k.active = (variant == &k) ? nullptr : variant;
+        k.selectedWorkgroups = workgroups;
+        k.selectedWorkgroupSize = workgroupSize;
+        replayArgs(k);
+    }
+
+    // outside of a submission scope every enqueue waits for the whole queue
+    void sync() {
+        if (_submissionDepth > 0) return;
+        clFlush(_oclQueue);
+        clFinish(_oclQueue);
+        releasePending();
+        if (_deviceTiming) resolveTimed(true);
+        resolveCounted(true);
+    }
+
+    // on out-of-order queues a command without a wait list waits for everything
+    // submitted since the previous such command, which keeps the in-order semantics
+    void prepare(const EventList * waitList) {
+        _wait.clear();
+        if (waitList) {
+            _wait = *waitList;
+        } else if (_outOfOrder) {
+            _wait = _pending;
+        }
+        _event = 0;
+    }
+
+    cl_uint nWait() const { return _wait.size(); }
+    const cl_event * waitList() const { return _wait.empty() ? NULL : _wait.data(); }
+    cl_event * eventPtr(Event * event) {
+        return (event || _outOfOrder || _deviceTiming || _timing.empty() == false) ? &_event : NULL;
+    }
+
+    // the event of a timed command is kept until the device has executed it
+    void timeCommand(const char * allId, const std::string & id) {
+        if (_event == 0) return;
+        clRetainEvent(_event);
+        _timed.push_back({ _event, allId, id });
+    }
+
+    // moves the timestamps of the executed commands into the profiler. without wait the
+    // polling stops at the first command that is not done, it never blocks
+    void resolveTimed(bool wait) {
+        while (_timed.empty() == false) {
+            auto & cmd = _timed.front();
+
+            if (wait) {
+                clWaitForEvents(1, &cmd.event);
+            } else {
+                cl_int status = CL_QUEUED;
+                clGetEventInfo(cmd.event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+                if (status > CL_COMPLETE) break;
+            }
+
+            cl_ulong tQueued = 0, tSubmit = 0, tStart = 0, tEnd = 0;
+            cl_int ret = clGetEventProfilingInfo(cmd.event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &tQueued, NULL);
+            ret |= clGetEventProfilingInfo(cmd.event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &tSubmit, NULL);
+            ret |= clGetEventProfilingInfo(cmd.event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &tStart, NULL);
+            ret |= clGetEventProfilingInfo(cmd.event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &tEnd, NULL);
+
+            // failed commands and commands of the GL interop have no timestamps on some drivers
+            if (ret == CL_SUCCESS && tEnd >= tStart && tStart >= tSubmit && tSubmit >= tQueued) {
+                float device = 1e-9f*(tEnd - tStart);
+                float queued = 1e-9f*(tStart - tQueued);
+                OCL_PROFILING_RECORD(cmd.allId, device, queued)
+                OCL_PROFILING_RECORD(cmd.id, device, queued)
+            }
+
+            clReleaseEvent(cmd.event);
+            _timed.pop_front();
+        }
+    }
+
+    // adds the execution time of the finished commands to their counters, same polling as resolveTimed
+    void resolveCounted(bool wait) {
+        while (_counted.empty() == false) {
+            auto & cmd = _counted.front();
+
+            if (wait) {
+                clWaitForEvents(1, &cmd.event);
+            } else {
+                cl_int status = CL_QUEUED;
+                clGetEventInfo(cmd.event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+                if (status > CL_COMPLETE) break;
+            }
+
+            cl_ulong tStart = 0, tEnd = 0;
+            cl_int ret = clGetEventProfilingInfo(cmd.event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &tStart, NULL);
+            ret |= clGetEventProfilingInfo(cmd.event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &tEnd, NULL);
+            if (ret == CL_SUCCESS && tEnd >= tStart) *cmd.counter += 1e-9*(tEnd - tStart);
+
+            clReleaseEvent(cmd.event);
+            _counted.pop_front();
+        }
+    }
+
+    void track(const EventList * waitList, Event * event) {
+        if (_deviceTiming) resolveTimed(false);
+        resolveCounted(false);
+        if (_event == 0) return;
+        if (_timing.empty() == false) {
+            clRetainEvent(_event);
+            _counted.push_back({ _event, _timing.back() });
+        }
+        if (_outOfOrder) {
+            if (waitList == nullptr) releasePending();
+            clRetainEvent(_event);
+            _pending.push_back(_event);
+        }
+        if (event) {
+            *event = _event;
+        } else {
+            clReleaseEvent(_event);
+        }
+        _event = 0;
+    }
+
+    void releasePending() {
+        for (auto e : _pending) clReleaseEvent(e);
+        _pending.clear();
+    }
+
+    // non-blocking writes inside a scope read from a copy, the caller may reuse its memory
+    const void * stage(bool block, size_t size, const void * ptr) {
+        if (block || _submissionDepth == 0 || ptr == NULL) return ptr;
+        if (_stagingUsed == (int) _staging.size()) _staging.emplace_back();
+        auto & buf = _staging[_stagingUsed++];
+        buf.resize(size);
+        std::memcpy(buf.data(), ptr, size);
+        return buf.data();
+    }
+
+    void * stage(bool block, size_t size, void * ptr) {
+        return const_cast<void *>(stage(block, size, (const void *) ptr));
+    }
+
+    struct Slab {
+        cl_mem V = 0;
+        cl_mem_flags flags = 0;
+        std::map<size_t, size_t> free; // offset -> size
+    };
+
+    // sizes up to 2^k are rounded up to multiples of 2^(k-2), at most 25% is wasted
+    static size_t poolBucket(size_t size) {
+        size_t step = 256;
+        while (step*4 < size) step *= 2;
+        return ((size + step - 1)/step)*step;
+    }
+
+    // small buffers are sub-buffers of a few large slabs, first-fit in the free ranges
+    bool allocateFromArena(Buffer & buffer, size_t size, cl_mem_flags flags) {
+        if (size > kArenaMaxSize) return false;
+
+        const size_t align = _support.subBufferAlignment;
+        const size_t capacity = ((size + align - 1)/align)*align;
+
+        int sid = -1;
+        size_t offset = 0;
+        for (int i = 0; i < (int) _slabs.size() && sid < 0; ++i) {
+            if (_slabs[i].flags != flags) continue;
+            for (const auto & range : _slabs[i].free) {
+                if (range.second < capacity) continue;
+                sid = i;
+                offset = range.first;
+                break;
+            }
+        }
+
+        // the indices are kept by the buffers, so released slabs leave a free slot
+        bool isNew = false;
+        if (sid < 0) {
+            cl_int ret;
+            Slab slab;
+            slab.V = clCreateBuffer(_oclContext, flags, kSlabSize, NULL, &ret);
+            if (ret != CL_SUCCESS || !slab.V) return false;
+            CG_IDBG(10, kLogTag, "Creating OpenCL arena slab. Size = %g MB\n", ((float)kSlabSize)/(1024*1024));
+            slab.flags = flags;
+            slab.free[0] = kSlabSize;
+            for (sid = 0; sid < (int) _slabs.size() && _slabs[sid].V; ++sid);
+            if (sid == (int) _slabs.size()) _slabs.emplace_back();
+            _slabs[sid] = std::move(slab);
+            isNew = true;
+        }
+
+        auto & slab = _slabs[sid];
+        cl_buffer_region region = { offset, size };
+        cl_int ret;
+        cl_mem V = clCreateSubBuffer(slab.V, 0, CL_BUFFER_CREATE_TYPE_REGION, &region, &ret);
+        if (ret != CL_SUCCESS || !V) {
+            if (isNew) releaseSlab(slab);
+            return false;
+        }
+
+        size_t rest = slab.free[offset] - capacity;
+        slab.free.erase(offset);
+        if (rest > 0) slab.free[offset + capacity] = rest;
+
+        buffer.V = V;
+        buffer.slab = sid;
+        buffer.offset = offset;
+        buffer.capacity = capacity;
+        return true;
+    }
+
+    void releaseSlab(Slab & slab) {
+        clReleaseMemObject(slab.V);
+        slab.V = 0;
+        slab.free.clear();
+    }
+
+    void releaseToArena(Buffer & buffer) {
+        clReleaseMemObject(buffer.V);
+
+        auto & slab = _slabs[buffer.slab];
+        auto & free = slab.free;
+        auto it = free.insert(std::make_pair(buffer.offset, buffer.capacity)).first;
+        auto next = std::next(it);
+        if (next != free.end() && it->first + it->second == next->first) {
+            it->second += next->second;
+            free.erase(next);
+        }
+        if (it != free.begin()) {
+            auto prev = std::prev(it);
+            if (prev->first + prev->second == it->first) {
+                prev->second += it->second;
+                free.erase(it);
+            }
+        }
+        if (free.size() == 1 && free.begin()->second == kSlabSize) releaseSlab(slab);
+        buffer.slab = -1;
+    }
+
+    bool allocateFromPool(Buffer & buffer, size_t size, cl_mem_flags flags) {
+        const size_t capacity = poolBucket(size);
+        auto it = _pool.find(std::make_pair(flags, capacity));
+        if (it != _pool.end() && it->second.empty() == false) {
+            buffer.V = it->second.back();
+            it->second.pop_back();
+            _pooledBytes -= capacity;
+        } else {
+            cl_int ret;
+            buffer.V = clCreateBuffer(_oclContext, flags, capacity, NULL, &ret);
+            if (ret != CL_SUCCESS || !buffer.V) return false;
+        }
+        buffer.capacity = capacity;
+        return true;
+    }
+
+    void recycle(Buffer & buffer) {
+        if (buffer.slab >= 0) {
+            releaseToArena(buffer);
+        } else if (_pooledBytes + buffer.capacity <= kPoolMaxBytes) {
+            _pool[std::make_pair(buffer.flags, buffer.capacity)].push_back(buffer.V);
+            _pooledBytes += buffer.capacity;
+        } else {
+            clReleaseMemObject(buffer.V);
+        }
+        buffer.pooled = false;
+    }
+
     cl_context       _oclContext = 0;
     cl_command_queue _oclQueue   = 0;
     cl_device_id     _oclDevice  = 0;
 
+    std::map<std::string, std::vector<std::string>> _kernelVariants;
+
+    bool _tuningCacheLoaded = false;
+    std::string _tuningCacheFile;
+    std::map<std::string, Tuning> _tuningCache;
+
+    bool _outOfOrder = false;
+    bool _deviceTiming = false;
+    int _submissionDepth = 0;
+
+    cl_event _event = 0;
+    std::vector<cl_event> _wait;
+    std::vector<cl_event> _pending;
+
+    struct TimedCommand {
+        cl_event event;
+        const char * allId;
+        std::string id;
+    };
+    std::deque<TimedCommand> _timed;
+
+    // open timing scopes and the commands waiting to be counted, the counters are in seconds
+    struct CountedCommand {
+        cl_event event;
+        double * counter;
+    };
+    std::vector<double *> _timing;
+    std::deque<CountedCommand> _counted;
+    std::map<std::string, double> _counters;
+
+    int _stagingUsed = 0;
+    std::vector<std::vector<char>> _staging;
+
+    std::vector<Slab> _slabs;
+
+    // released buffers by flags and bucket size
+    size_t _pooledBytes = 0;
+    std::map<std::pair<cl_mem_flags, size_t>, std::vector<cl_mem>> _pool;
+
     bool        _initialized = false;
     DeviceType  _deviceType = UNKNOWN;
     std::string _kernelPath = "./";
@@ -279,7 +986,12 @@ BaseManager::BaseManager() :
     _buildConfiguration(_data->_buildConfiguration),
     _support(_data->_support) {}
 
-BaseManager::~BaseManager() {}
+BaseManager::~BaseManager() {
+    releaseBufferPool();
+    for (auto & slab : _data->_slabs) {
+        if (slab.V) _data->releaseSlab(slab);
+    }
+}
 
 void BaseManager::configure(const std::string & /*fname*/) {
     configureDefault();
@@ -289,24 +1001,40 @@ void BaseManager::configureDefault() {
     int deviceID = 0;
     _deviceType = GPU_TYPE;
 
-    _buildConfiguration.recompile = true;
-    _buildConfiguration.buildArguments = "-D OPENCL_KERNEL_LANGUAGE -I ./kernels/lights/GPU -I ./kernels/render/GPU";
+    _buildConfiguration.recompile = false;
+    _buildConfiguration.cacheDir = userCacheDir();
+    _buildConfiguration.includeDirs = { "", "lights/GPU", "render/GPU" };
+    _buildConfiguration.buildArguments = "-D OPENCL_KERNEL_LANGUAGE";
 
     std::string kpath = "./kernels/";
 
     scanForAvailableDevices();
-    initialize(_deviceType, deviceID, true);
+    initialize(_deviceType, deviceID, true, true);
     setKernelPath(kpath);
 
     addKernelToLoad("buffers/GPU/fill.cl", "buffers_fill_float", "buffers_fill_float");
 
     addKernelToLoad("lights/GPU/geometry.cl", "drawFloor", "drawFloor");
     addKernelToLoad("lights/GPU/geometry.cl", "drawObjects", "drawObjects");
+    addKernelToLoad("lights/GPU/geometry.cl", "applyStamps", "applyStamps");
+    addKernelToLoad("lights/GPU/geometry.cl", "resampleObjects", "resampleObjects");
+    addKernelToLoad("lights/GPU/geometry.cl", "drawSprites", "drawSprites");
 
+    addKernelToLoad("lights/GPU/lightning.cl", "resetLightDistance", "resetLightDistance");
     addKernelToLoad("lights/GPU/lightning.cl", "calcDistance2", "calcDistance2");
+    addKernelToLoad("lights/GPU/lightning.cl", "calcDistance2Pairs", "calcDistance2Pairs");
+    addKernelToLoad("lights/GPU/lightning.cl", "resetLightDistanceWedges", "resetLightDistanceWedges");
+    addKernelToLoad("lights/GPU/lightning.cl", "calcDistanceWedges", "calcDistanceWedges");
+    addKernelToLoad("lights/GPU/lightning.cl", "copyLightDistance", "copyLightDistance");
+    addKernelToLoad("lights/GPU/lightning.cl", "accumulateShadow", "accumulateShadow");
+    addKernelToLoad("lights/GPU/lightning.cl", "calcDistanceSegments", "calcDistanceSegments");
     addKernelToLoad("lights/GPU/lightning.cl", "calcShadowMap2", "calcShadowMap2");
+    addKernelToLoad("lights/GPU/lightning.cl", "upsampleShadow", "upsampleShadow");
+    addKernelToLoad("lights/GPU/lightning.cl", "animateLights", "animateLights");
     loadKernels();
 
+    addKernelVariant("calcDistance2", "calcDistance2Pairs");
+
     listKernelInformation();
 
     //INFO("deviceType      = %d\n", _deviceType);
@@ -371,6 +1099,15 @@ void BaseManager::scanForAvailableDevices() {
             clGetDeviceInfo(devices[j], CL_DEVICE_VENDOR, valueSize, value, NULL);
             curDev.vendorName = std::string(value);
 
+            // driver version
+            clGetDeviceInfo(devices[j], CL_DRIVER_VERSION, 0, NULL, &valueSize);
+            clGetDeviceInfo(devices[j], CL_DRIVER_VERSION, valueSize, value, NULL);
+            curDev.driverVersion = std::string(value);
+
+            // CPU runtimes and integrated GPUs share memory with the host
+            clGetDeviceInfo(devices[j], CL_DEVICE_HOST_UNIFIED_MEMORY,
+                            sizeof(curDev.hostUnifiedMemory), &curDev.hostUnifiedMemory, NULL);
+
             // compute units
             clGetDeviceInfo(devices[j], CL_DEVICE_MAX_COMPUTE_UNITS,
                             sizeof(curDev.computeUnits), &curDev.computeUnits, NULL);
@@ -415,6 +1152,15 @@ void BaseManager::scanForAvailableDevices() {
             clGetDeviceInfo(devices[j], CL_DEVICE_VENDOR, valueSize, value, NULL);
             curDev.vendorName = std::string(value);
 
+            // driver version
+            clGetDeviceInfo(devices[j], CL_DRIVER_VERSION, 0, NULL, &valueSize);
+            clGetDeviceInfo(devices[j], CL_DRIVER_VERSION, valueSize, value, NULL);
+            curDev.driverVersion = std::string(value);
+
+            // CPU runtimes and integrated GPUs share memory with the host
+            clGetDeviceInfo(devices[j], CL_DEVICE_HOST_UNIFIED_MEMORY,
+                            sizeof(curDev.hostUnifiedMemory), &curDev.hostUnifiedMemory, NULL);
+
             // compute units
             clGetDeviceInfo(devices[j], CL_DEVICE_MAX_COMPUTE_UNITS,
                             sizeof(curDev.computeUnits), &curDev.computeUnits, NULL);
@@ -494,7 +1240,7 @@ void BaseManager::listKernelInformation() const {
     CG_IDBG(10, kLogTag, "\n");
 }
 
-void BaseManager::initialize(DeviceType dtype, int did, bool clglInterop) {
+void BaseManager::initialize(DeviceType dtype, int did, bool clglInterop, bool outOfOrder) {
     _deviceType  = dtype;
     auto & devices = _data->getDevices();
 
@@ -539,11 +1285,31 @@ void BaseManager::initialize(DeviceType dtype, int did, bool clglInterop) {
         throw Exception("Unable to create OpenCL context. ret = %d\n", ret);
     }
 
+    cl_command_queue_properties queueProps = 0;
+    if (outOfOrder) {
+        cl_command_queue_properties supported = 0;
+        clGetDeviceInfo(devices[did].deviceID, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported), &supported, NULL);
+        if (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) {
+            queueProps |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+        } else {
+            CG_IDBG(10, kLogTag, "Out-of-order queues are not supported. Using an in-order queue.\n");
+        }
+    }
+    _data->_outOfOrder = (queueProps & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+
+    // the timestamps are used by the autotuner. with OCL_PROFILING every command is timed on the device
+    queueProps |= CL_QUEUE_PROFILING_ENABLE;
+#ifdef OCL_PROFILING
+    _data->_deviceTiming = true;
+#endif
+
     OCL_PROFILING_START("clCreateCommandQueue", true)
 #if defined(CL_VERSION_2_0) && !defined(__linux__)
-    _data->_oclQueue = clCreateCommandQueueWithProperties(_data->_oclContext, devices[did].deviceID, 0, &ret);
+    cl_queue_properties queueProperties[] = { CL_QUEUE_PROPERTIES, queueProps, 0 };
+    _data->_oclQueue = clCreateCommandQueueWithProperties(_data->_oclContext, devices[did].deviceID,
+            queueProps ? queueProperties : NULL, &ret);
 #else
-    _data->_oclQueue = clCreateCommandQueue(_data->_oclContext, devices[did].deviceID, 0, &ret);
+    _data->_oclQueue = clCreateCommandQueue(_data->_oclContext, devices[did].deviceID, queueProps, &ret);
 #endif
     OCL_PROFILING_STOP("clCreateCommandQueue", true)
     if (ret != CL_SUCCESS || !_data->_oclQueue) throw Exception("Unable to create OpenCL queue.");
@@ -570,29 +1336,82 @@ void BaseManager::addKernelToLoad(const char *fname, const char *kname, const ch
     _kernelTree[fname].push_back(std::make_pair<std::string, std::string>(kname, kid));
 }
 
+void BaseManager::addKernelVariant(const char *kid, const char *variantKid) {
+    _data->_kernelVariants[kid].push_back(variantKid);
+}
+
 void BaseManager::loadKernels() {
     cl_int ret;
     if (!_initialized) {
         throw Exception("[OCLM] Cannot load kernels before initializing OpenCL.");
     }
 
+    struct ProgramBuild {
+        std::string fname;
+        cl_program program = 0;
+        bool cached = false;
+        float time = 0.0f;
+        std::string log;
+        std::exception_ptr error;
+    };
+
+    std::vector<ProgramBuild> builds(_kernelTree.size());
+
     CG_IDBG(10, kLogTag, "\n");
-    CG_IDBG(10, kLogTag, "Loading kernels ...\n");
-    for (const auto & node : _kernelTree) {
-        std::string fname(_kernelPath); fname += node.first;
+    CG_IDBG(10, kLogTag, "Compiling or loading %d source files ...\n", (int) builds.size());
 
-        CG_IDBG(10, kLogTag, "   Compiling or loading source file '%s' ...", fname.c_str());
+    // the programs are independent, so all of them are built at the same time
+    {
+        CG::Timer timer; timer.start();
+
+        std::vector<std::thread> workers;
+        int bid = 0;
+        for (const auto & node : _kernelTree) {
+            auto & build = builds[bid++];
+            build.fname = _kernelPath + node.first;
+            workers.push_back(std::thread([this, &build, &node]() {
+                CG::Timer bTimer; bTimer.start();
+                try {
+                    build.cached = _data->compileOrLoadProgram(
+                        node.first, build.program, _data->_oclContext, _data->_oclDevice, build.log);
+                } catch (...) {
+                    build.error = std::current_exception();
+                }
+                build.time = bTimer.time();
+            }));
+        }
+        for (auto & worker : workers) worker.join();
 
-        cl_program program;
-        _data->compileOrLoadProgram(fname.c_str(), program, _data->_oclContext, _data->_oclDevice);
+        for (const auto & build : builds) {
+            if (build.error) continue;
+            CG_IDBG(10, kLogTag, "   %-40s %s in %g sec\n", build.fname.c_str(),
+                    build.cached ? "loaded" : "compiled", build.time);
+            if (build.log.empty() == false) CG_INFOC(10, "\n%s\n\n", build.log.c_str());
+        }
+        CG_IDBG(10, kLogTag, "   all programs ready in %g sec\n", timer.time());
+
+        for (auto & build : builds) {
+            if (build.error == nullptr) continue;
+            for (auto & other : builds) {
+                if (other.program) clReleaseProgram(other.program);
+            }
+            std::rethrow_exception(build.error);
+        }
+    }
+
+    CG_IDBG(10, kLogTag, "Loading kernels ...\n");
+    int bid = 0;
+    for (const auto & node : _kernelTree) {
+        cl_program program = builds[bid++].program;
 
         for (int i = 0; i < (int) node.second.size(); ++i) {
             CG_IDBG(10, kLogTag, "     - Loading kernel '%s' ...", node.second[i].second.c_str());
 
             CG::Timer kTimer; kTimer.start();
 
-            Kernel &curKernel = _kernels[node.second[i].second];
+            Kernel &curKernel = _data->getKernel(node.second[i].second);
             curKernel.K = clCreateKernel(program, node.second[i].first.c_str(), &ret);
+            curKernel.args.clear();
             if (ret != CL_SUCCESS || !curKernel.K) {
                 throw Exception("[OCLM] Unable to create OpenCL '%s' kernel. (ret = %d)", node.second[i].first.c_str(), ret);
             }
@@ -644,6 +1463,17 @@ void BaseManager::allocateMemory() {};
 bool BaseManager::isInitialized() const { return _initialized; }
 void BaseManager::setKernelPath(const std::string &kpath) { _kernelPath = kpath; }
 
+void BaseManager::setBinaryCacheDir(const std::string &path) {
+    _buildConfiguration.cacheDir = path;
+    if (path.empty() == false && path.back() != '/') _buildConfiguration.cacheDir += '/';
+
+    // the tuning results move along unless they have a file of their own
+    if (_data->_tuningCacheFile.empty()) {
+        _data->_tuningCacheLoaded = false;
+        _data->_tuningCache.clear();
+    }
+}
+
 int BaseManager::getOptimumWorkgroups() const {
     return _data->getSelectedDevice().optimumWorkgroups;
 }
@@ -666,25 +1496,142 @@ void BaseManager::setKernelArg(
     const int aid,
     const int asize,
     void *a) {
-    cl_int ret;
-
-    ret = clSetKernelArg(_kernels[kname].K, aid, asize, a);
-    if (ret != CL_SUCCESS) {
-        throw Exception("Unable to set kernel argument %d for kernel '%s'. ret = %d",
-                        aid, kname.c_str(), ret);
-    }
+    _data->setArg(_data->getKernel(kname), aid, asize, a);
 }
 
 void BaseManager::setKernelArgAsBuffer(
     const std::string &kname,
     const int aid,
     const std::string &bname) {
-    cl_int ret;
+    _data->setArg(_data->getKernel(kname), aid, _buffers[bname]);
+}
 
-    ret = clSetKernelArg(_kernels[kname].K, aid, sizeof(cl_mem), &_buffers[bname].V);
-    if (ret != CL_SUCCESS) {
-        throw Exception("Unable to set kernel argument %d for kernel '%s'. ret = %d",
-                        aid, kname.c_str(), ret);
+BaseManager::KernelHandle BaseManager::getKernelHandle(const std::string &kname) {
+    return KernelHandle(&_data->getKernel(kname));
+}
+
+BaseManager::BufferHandle BaseManager::getBufferHandle(const std::string &bname) {
+    return BufferHandle(&_buffers[bname]);
+}
+
+void BaseManager::setKernelArg(
+    const KernelHandle &kernel,
+    const int aid,
+    const int asize,
+    const void *a) {
+    _data->setArg(*kernel._kernel, aid, asize, a);
+}
+
+void BaseManager::setKernelArgAsBuffer(
+    const KernelHandle &kernel,
+    const int aid,
+    const BufferHandle &buffer) {
+    _data->setArg(*kernel._kernel, aid, *buffer._buffer);
+}
+
+void BaseManager::setTuningCacheFile(const std::string &fname) {
+    _data->_tuningCacheFile = fname;
+    _data->_tuningCacheLoaded = false;
+    _data->_tuningCache.clear();
+}
+
+void BaseManager::autotuneKernel(const KernelHandle &kernel, const int problemSize, const std::string &workload) {
+    auto & k = *kernel._kernel;
+    k.tunedProblemSize = problemSize;
+
+    auto candidates = _data->variantsOf(k);
+
+    _data->loadTuningCache();
+    const std::string key = _data->tuningKey(k.name, workload, problemSize);
+    {
+        auto it = _data->_tuningCache.find(key);
+        if (it != _data->_tuningCache.end()) {
+            for (auto c : candidates) {
+                if (c->name != it->second.variant) continue;
+                CG_IDBG(10, kLogTag, "Using tuned '%s' for kernel '%s' (%lu, %lu)\n", c->name.c_str(), k.name.c_str(),
+                        it->second.workgroups, it->second.workgroupSize);
+                _data->applyVariant(k, c, it->second.workgroups, it->second.workgroupSize);
+                return;
+            }
+        }
+    }
+
+    const auto & device = _data->getSelectedDevice();
+    const int nRuns = 3;
+
+    float bestTime = -1.0f;
+    Data::Tuning best;
+    Kernel * bestKernel = &k;
+    best.workgroups = k.selectedWorkgroups;
+    best.workgroupSize = k.selectedWorkgroupSize;
+
+    CG_IDBG(10, kLogTag, "Autotuning kernel '%s' for problem size %d ...\n", k.name.c_str(), problemSize);
+    for (auto c : candidates) {
+        _data->applyVariant(k, c, k.selectedWorkgroups, k.selectedWorkgroupSize);
+
+        // workgroup sizes are multiples of the preferred multiple, the counts multiples of the compute units
+        size_t maxSize = std::min(c->maxWorkgroupSize, device.maxWorkgroup);
+        size_t minSize = std::min(std::max(c->workgroupSizeMultiple, (size_t) 1), maxSize);
+        for (size_t wgs = minSize; wgs <= maxSize; wgs *= 2) {
+            for (size_t m = 1; m <= 16; m *= 2) {
+                size_t ngrps = m*device.computeUnits;
+                float t = _data->timeKernel(c->K, ngrps, wgs, 1);
+                if (t < 0.0f) continue;
+                t = _data->timeKernel(c->K, ngrps, wgs, nRuns);
+                if (t < 0.0f) continue;
+
+                if (bestTime < 0.0f || t < bestTime) {
+                    bestTime = t;
+                    bestKernel = c;
+                    best.variant = c->name;
+                    best.workgroups = ngrps;
+                    best.workgroupSize = wgs;
+                }
+            }
+        }
+    }
+
+    _data->applyVariant(k, bestKernel, best.workgroups, best.workgroupSize);
+    if (bestTime < 0.0f) return;
+
+    CG_IDBG(10, kLogTag, "  best '%s' (%lu, %lu) - %g ms\n", best.variant.c_str(),
+            best.workgroups, best.workgroupSize, 1000.0f*bestTime);
+
+    _data->_tuningCache[key] = best;
+    _data->saveTuningCache();
+}
+
+void BaseManager::selectTunedKernel(const KernelHandle &kernel, const int problemSize, const std::string &workload) {
+    auto & k = *kernel._kernel;
+    if (k.tunedProblemSize == problemSize) return;
+    k.tunedProblemSize = problemSize;
+
+    _data->loadTuningCache();
+
+    // the closest tuned size on a log scale, for this workload, device and driver
+    const auto & device = _data->getSelectedDevice();
+    const Data::Tuning * tuning = nullptr;
+    double bestDist = 0.0;
+    for (const auto & entry : _data->_tuningCache) {
+        std::vector<std::string> fields;
+        std::stringstream ss(entry.first);
+        std::string field;
+        while (std::getline(ss, field, '\t')) fields.push_back(field);
+        if (fields.size() != 5 || fields[0] != k.name || fields[1] != workload ||
+            fields[3] != device.name || fields[4] != device.driverVersion) continue;
+
+        double dist = std::fabs(std::log(std::max(1.0, std::stod(fields[2]))) - std::log(std::max(1, problemSize)));
+        if (tuning == nullptr || dist < bestDist) {
+            tuning = &entry.second;
+            bestDist = dist;
+        }
+    }
+    if (tuning == nullptr) return;
+
+    for (auto c : _data->variantsOf(k)) {
+        if (c->name != tuning->variant) continue;
+        _data->applyVariant(k, c, tuning->workgroups, tuning->workgroupSize);
+        return;
     }
 }
 
@@ -717,26 +1664,77 @@ void BaseManager::finish() {
     clFinish(_data->_oclQueue);
 }
 
+void BaseManager::beginSubmission() {
+    ++_data->_submissionDepth;
+}
+
+void BaseManager::endSubmission() {
+    if (_data->_submissionDepth == 0) return;
+    if (--_data->_submissionDepth > 0) return;
+
+    flush();
+    _data->releasePending();
+    _data->_stagingUsed = 0;
+    if (_data->_deviceTiming) _data->resolveTimed(true);
+    _data->resolveCounted(true);
+}
+
+bool BaseManager::isOutOfOrder() const { return _data->_outOfOrder; }
+
+void BaseManager::beginTiming(const std::string &counter) {
+    _data->_timing.push_back(&_data->_counters[counter]);
+}
+
+void BaseManager::endTiming() {
+    if (_data->_timing.empty() == false) _data->_timing.pop_back();
+}
+
+float BaseManager::takeTiming(const std::string &counter) {
+    _data->resolveCounted(false);
+    double & t = _data->_counters[counter];
+    float res = t;
+    t = 0.0;
+    return res;
+}
+
+void BaseManager::waitForEvents(const EventList &events) {
+    if (events.empty()) return;
+
+    cl_int ret = clWaitForEvents(events.size(), events.data());
+    if (ret != CL_SUCCESS) {
+        throw Exception("Unable to wait for %d OpenCL events. ret = %d", (int) events.size(), ret);
+    }
+}
+
+void BaseManager::releaseEvent(Event event) {
+    if (event) clReleaseEvent(event);
+}
+
 void BaseManager::fillBufferFloat(
     const std::string &bname,
     const cl_float f,
-    const int bsize) {
+    const int bsize,
+    const EventList *waitList,
+    Event *event) {
     cl_int ret;
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_START("oclBuffer_fillFloat_ALL", true);
-    OCL_PROFILING_START("oclBuffer_fillFloat_"+bname, true);
+    OCL_PROFILING_START("oclBuffer_fillFloat_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START("oclBuffer_fillFloat_"+bname, _data->_deviceTiming == false);
 
     if (_support.clEnqueueFillBuffer) {
+        _data->prepare(waitList);
         ret = clEnqueueFillBuffer(
                 _data->_oclQueue, _buffers[bname].V, &f, sizeof(cl_float), 0, bsize*sizeof(cl_float),
-                0, NULL, NULL);
+                _data->nWait(), _data->waitList(), _data->eventPtr(event));
 
         if (ret != CL_SUCCESS) {
             throw Exception("Unable to fill buffer '%s' with floats. ret = %d",
                     bname.c_str(), ret);
         }
+        if (_data->_deviceTiming) _data->timeCommand("oclBuffer_fillFloat_ALL", "oclBuffer_fillFloat_"+bname);
+        _data->track(waitList, event);
     } else {
         if (_kernels.find(Constants::KernelNames::kBuffersFillFloat) == _kernels.end()) {
             throw Exception("No support for support clEnqueueFillBuffer and missing kernel '%s'\n",
@@ -749,96 +1747,199 @@ void BaseManager::fillBufferFloat(
             setKernelArg(Constants::KernelNames::kBuffersFillFloat, 1, sizeof(cl_uint), &bufSize);
             setKernelArg(Constants::KernelNames::kBuffersFillFloat, 2, sizeof(cl_float), &fval);
 
-            runKernelOptimum(Constants::KernelNames::kBuffersFillFloat);
+            runKernelOptimum(Constants::KernelNames::kBuffersFillFloat, waitList, event);
         }
     }
 
-    flush();
+    _data->sync();
+
+    OCL_PROFILING_STOP("oclBuffer_fillFloat_"+bname, _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("oclBuffer_fillFloat_ALL", _data->_deviceTiming == false);
+}
 
-    OCL_PROFILING_STOP("oclBuffer_fillFloat_"+bname, true);
-    OCL_PROFILING_STOP("oclBuffer_fillFloat_ALL", true);
+void BaseManager::writeBuffer(
+    const std::string &bname,
+    const bool block,
+    const int bsize,
+    const void *bptr,
+    const EventList *waitList,
+    Event *event) {
+    writeBuffer(bname, block, 0, bsize, bptr, waitList, event);
 }
 
 void BaseManager::writeBuffer(
     const std::string &bname,
     const bool block,
+    const int offset,
     const int bsize,
-    const void *bptr) {
+    const void *bptr,
+    const EventList *waitList,
+    Event *event) {
     cl_int ret;
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_START("oclBuffer_write_ALL", true);
-    OCL_PROFILING_START("oclBuffer_write_"+bname, true);
+    OCL_PROFILING_START("oclBuffer_write_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START("oclBuffer_write_"+bname, _data->_deviceTiming == false);
 
+    _data->prepare(waitList);
     ret = clEnqueueWriteBuffer(
-              _data->_oclQueue, _buffers[bname].V, block, 0, bsize, bptr,
-              0, NULL, NULL);
+              _data->_oclQueue, _buffers[bname].V, block, offset, bsize, _data->stage(block, bsize, bptr),
+              _data->nWait(), _data->waitList(), _data->eventPtr(event));
 
     if (ret != CL_SUCCESS) {
         throw Exception("Unable to write buffer '%s' to OpenCL device. ret = %d",
                         bname.c_str(), ret);
     }
+    if (_data->_deviceTiming) _data->timeCommand("oclBuffer_write_ALL", "oclBuffer_write_"+bname);
+    _data->track(waitList, event);
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_STOP("oclBuffer_write_"+bname, true);
-    OCL_PROFILING_STOP("oclBuffer_write_ALL", true);
+    OCL_PROFILING_STOP("oclBuffer_write_"+bname, _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("oclBuffer_write_ALL", _data->_deviceTiming == false);
 }
 
 void BaseManager::readBuffer(
     const std::string &bname,
     const bool block,
     const int bsize,
-    void *bptr) {
+    void *bptr,
+    const EventList *waitList,
+    Event *event) {
     cl_int ret;
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_START("oclBuffer_read_ALL", true);
-    OCL_PROFILING_START("oclBuffer_read_"+bname, true);
+    OCL_PROFILING_START("oclBuffer_read_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START("oclBuffer_read_"+bname, _data->_deviceTiming == false);
 
+    _data->prepare(waitList);
     ret = clEnqueueReadBuffer(
               _data->_oclQueue, _buffers[bname].V, block, 0, bsize, bptr,
-              0, NULL, NULL);
+              _data->nWait(), _data->waitList(), _data->eventPtr(event));
 
     if (ret != CL_SUCCESS) {
         throw Exception("Unable to read buffer '%s' from OpenCL device. ret = %d",
                         bname.c_str(), ret);
     }
+    if (_data->_deviceTiming) _data->timeCommand("oclBuffer_read_ALL", "oclBuffer_read_"+bname);
+    _data->track(waitList, event);
 
-    flush();
+    _data->sync();
+
+    OCL_PROFILING_STOP("oclBuffer_read_"+bname, _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("oclBuffer_read_ALL", _data->_deviceTiming == false);
+}
+
+void * BaseManager::mapBuffer(
+    const std::string &bname,
+    const bool block,
+    const MapFlags flags,
+    const int offset,
+    const int bsize,
+    const EventList *waitList,
+    Event *event) {
+    cl_int ret;
+
+    _data->sync();
 
-    OCL_PROFILING_STOP("oclBuffer_read_"+bname, true);
-    OCL_PROFILING_STOP("oclBuffer_read_ALL", true);
+    OCL_PROFILING_START("oclBuffer_map_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START("oclBuffer_map_"+bname, _data->_deviceTiming == false);
+
+    cl_map_flags mapFlags = 0;
+    if (flags & MAP_READ) mapFlags |= CL_MAP_READ;
+    if (flags & MAP_WRITE) mapFlags |= CL_MAP_WRITE;
+    if (flags & MAP_WRITE_INVALIDATE) mapFlags |= CL_MAP_WRITE_INVALIDATE_REGION;
+
+    _data->prepare(waitList);
+    void * ptr = clEnqueueMapBuffer(
+              _data->_oclQueue, _buffers[bname].V, block, mapFlags, offset, bsize,
+              _data->nWait(), _data->waitList(), _data->eventPtr(event), &ret);
+
+    if (ret != CL_SUCCESS || ptr == NULL) {
+        throw Exception("Unable to map buffer '%s'. ret = %d",
+                        bname.c_str(), ret);
+    }
+    if (_data->_deviceTiming) _data->timeCommand("oclBuffer_map_ALL", "oclBuffer_map_"+bname);
+    _data->track(waitList, event);
+
+    _data->sync();
+
+    OCL_PROFILING_STOP("oclBuffer_map_"+bname, _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("oclBuffer_map_ALL", _data->_deviceTiming == false);
+
+    return ptr;
+}
+
+void BaseManager::unmapBuffer(
+    const std::string &bname,
+    void *ptr,
+    const EventList *waitList,
+    Event *event) {
+    cl_int ret;
+
+    _data->sync();
+
+    OCL_PROFILING_START("oclBuffer_unmap_ALL", _data->_deviceTiming == false);
+
+    _data->prepare(waitList);
+    ret = clEnqueueUnmapMemObject(
+              _data->_oclQueue, _buffers[bname].V, ptr,
+              _data->nWait(), _data->waitList(), _data->eventPtr(event));
+
+    if (ret != CL_SUCCESS) {
+        throw Exception("Unable to unmap buffer '%s'. ret = %d",
+                        bname.c_str(), ret);
+    }
+    if (_data->_deviceTiming) _data->timeCommand("oclBuffer_unmap_ALL", "oclBuffer_unmap_"+bname);
+    _data->track(waitList, event);
+
+    _data->sync();
+
+    OCL_PROFILING_STOP("oclBuffer_unmap_ALL", _data->_deviceTiming == false);
+}
+
+bool BaseManager::isHostUnifiedMemory() const {
+    return _data->getSelectedDevice().hostUnifiedMemory == CL_TRUE;
+}
+
+bool BaseManager::isHostVisible(const std::string &bname) const {
+    auto it = _buffers.find(bname);
+    return it != _buffers.end() && it->second.host != nullptr;
 }
 
 void BaseManager::copyBuffer(
     const std::string &srcname,
     const std::string &dstname,
-    const int bsize) {
+    const int bsize,
+    const EventList *waitList,
+    Event *event) {
     cl_int ret;
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_START("oclBuffer_copy_ALL", true);
-    OCL_PROFILING_START("oclBuffer_copy_"+srcname, true);
+    OCL_PROFILING_START("oclBuffer_copy_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START("oclBuffer_copy_"+srcname, _data->_deviceTiming == false);
 
+    _data->prepare(waitList);
     ret = clEnqueueCopyBuffer(
               _data->_oclQueue,
               _buffers[srcname].V,
               _buffers[dstname].V,
-              0, 0, bsize, 0, NULL, NULL);
+              0, 0, bsize, _data->nWait(), _data->waitList(), _data->eventPtr(event));
 
     if (ret != CL_SUCCESS) {
         throw Exception("Unable to copy OpenCL buffer '%s' to buffer '%s'. ret = %d",
                         srcname.c_str(), dstname.c_str(), ret);
     }
+    if (_data->_deviceTiming) _data->timeCommand("oclBuffer_copy_ALL", "oclBuffer_copy_"+srcname);
+    _data->track(waitList, event);
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_STOP("oclBuffer_copy_"+srcname, true);
-    OCL_PROFILING_STOP("oclBuffer_copy_ALL", true);
+    OCL_PROFILING_STOP("oclBuffer_copy_"+srcname, _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("oclBuffer_copy_ALL", _data->_deviceTiming == false);
 }
 
 void BaseManager::copyImage(
@@ -846,33 +1947,38 @@ void BaseManager::copyImage(
     const std::string &dstname,
     const int nx,
     const int ny,
-    const int nz) {
+    const int nz,
+    const EventList *waitList,
+    Event *event) {
     cl_int ret;
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_START("oclImage_copy_ALL", true);
-    OCL_PROFILING_START("oclImage_copy_"+srcname, true);
+    OCL_PROFILING_START("oclImage_copy_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START("oclImage_copy_"+srcname, _data->_deviceTiming == false);
 
     size_t src_origin[3] = {0, 0, 0};
     size_t dst_origin[3] = {0, 0, 0};
     size_t range[3] = {(size_t) nx, (size_t) ny, (size_t) nz};
 
+    _data->prepare(waitList);
     ret = clEnqueueCopyImage(
               _data->_oclQueue,
               _buffers[srcname].V,
               _buffers[dstname].V,
-              src_origin, dst_origin, range, 0, NULL, NULL);
+              src_origin, dst_origin, range, _data->nWait(), _data->waitList(), _data->eventPtr(event));
 
     if (ret != CL_SUCCESS) {
         throw Exception("Unable to copy OpenCL image '%s' to image '%s'. ret = %d",
                         srcname.c_str(), dstname.c_str(), ret);
     }
+    if (_data->_deviceTiming) _data->timeCommand("oclImage_copy_ALL", "oclImage_copy_"+srcname);
+    _data->track(waitList, event);
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_STOP("oclImage_copy_"+srcname, true);
-    OCL_PROFILING_STOP("oclImage_copy_ALL", true);
+    OCL_PROFILING_STOP("oclImage_copy_"+srcname, _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("oclImage_copy_ALL", _data->_deviceTiming == false);
 }
 
 void BaseManager::writeImageFloat3D(
@@ -881,42 +1987,60 @@ void BaseManager::writeImageFloat3D(
     const int nx,
     const int ny,
     const int nz,
-    void *bptr) {
+    void *bptr,
+    const EventList *waitList,
+    Event *event) {
     cl_int ret;
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_START("oclBuffer_write_ALL", true);
-    OCL_PROFILING_START("oclBuffer_write_"+iname, true);
+    OCL_PROFILING_START("oclBuffer_write_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START("oclBuffer_write_"+iname, _data->_deviceTiming == false);
 
     size_t origin[3] = {0, 0, 0};
     size_t range[3]  = {(size_t) nx, (size_t) ny, (size_t) nz};
 
+    _data->prepare(waitList);
     ret = clEnqueueWriteImage(
               _data->_oclQueue, _buffers[iname].V, block, origin, range,
-              nx*sizeof(float), nx*ny*sizeof(float), bptr, 0, NULL, NULL);
+              nx*sizeof(float), nx*ny*sizeof(float), _data->stage(block, nx*ny*nz*sizeof(float), bptr),
+              _data->nWait(), _data->waitList(), _data->eventPtr(event));
 
     if (ret != CL_SUCCESS) {
         throw Exception("Unable to write OpenCL 3D image '%s'. ret = %d",
                         iname.c_str(), ret);
     }
+    if (_data->_deviceTiming) _data->timeCommand("oclBuffer_write_ALL", "oclBuffer_write_"+iname);
+    _data->track(waitList, event);
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_STOP("oclBuffer_write_ALL", true);
-    OCL_PROFILING_STOP("oclBuffer_write_"+iname, true);
+    OCL_PROFILING_STOP("oclBuffer_write_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("oclBuffer_write_"+iname, _data->_deviceTiming == false);
 }
 
 void BaseManager::runKernel(
     const std::string &kname,
     const int nWorkgroups,
-    const int workgroupSize) {
-    CG_IDBG(20, kLogTag, "Running kernel '%s' (%d, %d) ... \n", kname.c_str(), nWorkgroups, workgroupSize);
+    const int workgroupSize,
+    const EventList *waitList,
+    Event *event) {
+    runKernel(getKernelHandle(kname), nWorkgroups, workgroupSize, waitList, event);
+}
 
-    flush();
+void BaseManager::runKernel(
+    const KernelHandle &kernel,
+    const int nWorkgroups,
+    const int workgroupSize,
+    const EventList *waitList,
+    Event *event) {
+    auto & k = *kernel._kernel;
+    CG_IDBG(20, kLogTag, "Running kernel '%s' (%d, %d) ... \n", k.name.c_str(), nWorkgroups, workgroupSize);
+
+    _data->sync();
 
-    OCL_PROFILING_START("kernel_ALL", true);
-    OCL_PROFILING_START("kernel_" + kname, true);
+    OCL_PROFILING_START("kernel_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START(k.profileId, _data->_deviceTiming == false);
 
     size_t local_item_size  =
         (workgroupSize == -1) ? _data->getSelectedDevice().optimumWorkgroupSize : workgroupSize;
@@ -924,95 +2048,122 @@ void BaseManager::runKernel(
 
     cl_int ret;
 
+    _data->prepare(waitList);
     ret = clEnqueueNDRangeKernel(
-              _data->_oclQueue, _kernels[kname].K,
+              _data->_oclQueue, k.target().K,
               1, NULL, &global_item_size, &local_item_size,
-              0, NULL, NULL);
+              _data->nWait(), _data->waitList(), _data->eventPtr(event));
     if (ret != CL_SUCCESS) {
-        throw Exception("Unable to run '%s' kernel. ret = %d", kname.c_str(), ret);
+        throw Exception("Unable to run '%s' kernel. ret = %d", k.name.c_str(), ret);
     }
+    if (_data->_deviceTiming) _data->timeCommand("kernel_ALL", k.profileId);
+    _data->track(waitList, event);
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_STOP("kernel_" + kname, true);
-    OCL_PROFILING_STOP("kernel_ALL", true);
+    OCL_PROFILING_STOP(k.profileId, _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("kernel_ALL", _data->_deviceTiming == false);
 }
 
-void BaseManager::runKernelSelected(const std::string &kname) {
-    CG_IDBG(20, kLogTag, "Running kernel '%s' with selected parameters (%ld, %ld)...\n", kname.c_str(),
-            _kernels[kname].selectedWorkgroups,
-            _kernels[kname].selectedWorkgroupSize);
+void BaseManager::runKernelSelected(
+    const std::string &kname,
+    const EventList *waitList,
+    Event *event) {
+    runKernelSelected(getKernelHandle(kname), waitList, event);
+}
 
-    flush();
+void BaseManager::runKernelSelected(
+    const KernelHandle &kernel,
+    const EventList *waitList,
+    Event *event) {
+    auto & k = *kernel._kernel;
+    CG_IDBG(20, kLogTag, "Running kernel '%s' with selected parameters (%ld, %ld)...\n", k.name.c_str(),
+            k.selectedWorkgroups,
+            k.selectedWorkgroupSize);
 
-    OCL_PROFILING_START("kernel_ALL", true);
-    OCL_PROFILING_START("kernel_" + kname, true);
+    _data->sync();
 
-    int ngrps = _kernels[kname].selectedWorkgroups;
+    OCL_PROFILING_START("kernel_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START(k.profileId, _data->_deviceTiming == false);
 
-    size_t local_item_size  = _kernels[kname].selectedWorkgroupSize;
+    int ngrps = k.selectedWorkgroups;
+
+    size_t local_item_size  = k.selectedWorkgroupSize;
     size_t global_item_size = local_item_size*ngrps;
 
     cl_int ret;
 
+    _data->prepare(waitList);
     ret = clEnqueueNDRangeKernel(
-              _data->_oclQueue, _kernels[kname].K,
+              _data->_oclQueue, k.target().K,
               1, NULL, &global_item_size, &local_item_size,
-              0, NULL, NULL);
+              _data->nWait(), _data->waitList(), _data->eventPtr(event));
     if (ret != CL_SUCCESS) {
-        throw Exception("Unable to run '%s' kernel. ret = %d", kname.c_str(), ret);
+        throw Exception("Unable to run '%s' kernel. ret = %d", k.name.c_str(), ret);
     }
+    if (_data->_deviceTiming) _data->timeCommand("kernel_ALL", k.profileId);
+    _data->track(waitList, event);
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_STOP("kernel_" + kname, true);
-    OCL_PROFILING_STOP("kernel_ALL", true);
+    OCL_PROFILING_STOP(k.profileId, _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("kernel_ALL", _data->_deviceTiming == false);
 }
 
-void BaseManager::runKernelOptimum(const std::string &kname) {
+void BaseManager::runKernelOptimum(
+    const std::string &kname,
+    const EventList *waitList,
+    Event *event) {
+    auto & k = _data->getKernel(kname);
     CG_IDBG(20, kLogTag, "Running kernel '%s' with optimum parameters (%ld, %ld)...\n", kname.c_str(),
-            _kernels[kname].bestWorkgroups,
-            _kernels[kname].bestWorkgroupSize);
+            k.bestWorkgroups,
+            k.bestWorkgroupSize);
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_START("kernel_ALL", true);
-    OCL_PROFILING_START("kernel_" + kname, true);
+    OCL_PROFILING_START("kernel_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START(k.profileId, _data->_deviceTiming == false);
 
-    int ngrps = _kernels[kname].bestWorkgroups;
+    int ngrps = k.bestWorkgroups;
 
-    size_t local_item_size  = _kernels[kname].bestWorkgroupSize;
+    size_t local_item_size  = k.bestWorkgroupSize;
     size_t global_item_size = local_item_size*ngrps;
 
     cl_int ret;
 
+    _data->prepare(waitList);
     ret = clEnqueueNDRangeKernel(
-              _data->_oclQueue, _kernels[kname].K,
+              _data->_oclQueue, k.target().K,
               1, NULL, &global_item_size, &local_item_size,
-              0, NULL, NULL);
+              _data->nWait(), _data->waitList(), _data->eventPtr(event));
     if (ret != CL_SUCCESS) {
         throw Exception("Unable to run '%s' kernel. ret = %d", kname.c_str(), ret);
     }
+    if (_data->_deviceTiming) _data->timeCommand("kernel_ALL", k.profileId);
+    _data->track(waitList, event);
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_STOP("kernel_" + kname, true);
-    OCL_PROFILING_STOP("kernel_ALL", true);
+    OCL_PROFILING_STOP(k.profileId, _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("kernel_ALL", _data->_deviceTiming == false);
 }
 
 void BaseManager::runKernelOptimum(
     const std::string &kname,
     const int nTotalWorkItems,
     const int nPerGroupAID,
-    const int nPerWorkitemAID) {
+    const int nPerWorkitemAID,
+    const EventList *waitList,
+    Event *event) {
+    auto & k = _data->getKernel(kname);
     CG_IDBG(20, kLogTag, "Running kernel '%s' with optimum parameters (%d, %d)...\n", kname.c_str(),
             _data->getSelectedDevice().optimumWorkgroups,
             _data->getSelectedDevice().optimumWorkgroupSize);
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_START("kernel_ALL", true);
-    OCL_PROFILING_START("kernel_" + kname, true);
+    OCL_PROFILING_START("kernel_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START(k.profileId, _data->_deviceTiming == false);
 
     int ngrps = _data->getSelectedDevice().optimumWorkgroups;
 
@@ -1022,23 +2173,26 @@ void BaseManager::runKernelOptimum(
     unsigned int nPerGroup    = (nTotalWorkItems + ngrps - 1)/ngrps;
     unsigned int nPerWorkitem = (nPerGroup+local_item_size-1)/local_item_size;
 
-    cl_int ret;
+    _data->setArg(k, nPerGroupAID, sizeof(unsigned int), &nPerGroup);
+    _data->setArg(k, nPerWorkitemAID, sizeof(unsigned int), &nPerWorkitem);
 
-    ret  = clSetKernelArg(_kernels[kname].K, nPerGroupAID, sizeof(unsigned int), &nPerGroup);
-    ret |= clSetKernelArg(_kernels[kname].K, nPerWorkitemAID, sizeof(unsigned int), &nPerWorkitem);
+    cl_int ret;
 
-    ret |= clEnqueueNDRangeKernel(
-               _data->_oclQueue, _kernels[kname].K,
-               1, NULL, &global_item_size, &local_item_size,
-               0, NULL, NULL);
+    _data->prepare(waitList);
+    ret = clEnqueueNDRangeKernel(
+              _data->_oclQueue, k.target().K,
+              1, NULL, &global_item_size, &local_item_size,
+              _data->nWait(), _data->waitList(), _data->eventPtr(event));
     if (ret != CL_SUCCESS) {
         throw Exception("Unable to run '%s' kernel. ret = %d", kname.c_str(), ret);
     }
+    if (_data->_deviceTiming) _data->timeCommand("kernel_ALL", k.profileId);
+    _data->track(waitList, event);
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_STOP("kernel_" + kname, true);
-    OCL_PROFILING_STOP("kernel_ALL", true);
+    OCL_PROFILING_STOP(k.profileId, _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("kernel_ALL", _data->_deviceTiming == false);
 }
 
 void BaseManager::runKernel2D(
@@ -1046,75 +2200,107 @@ void BaseManager::runKernel2D(
     const int globalx,
     const int globaly,
     const int localx,
-    const int localy) {
-    CG_IDBG(20, kLogTag, "Running kernel '%s' ... \n", kname.c_str());
+    const int localy,
+    const EventList *waitList,
+    Event *event) {
+    runKernel2D(getKernelHandle(kname), globalx, globaly, localx, localy, waitList, event);
+}
 
-    flush();
+void BaseManager::runKernel2D(
+    const KernelHandle &kernel,
+    const int globalx,
+    const int globaly,
+    const int localx,
+    const int localy,
+    const EventList *waitList,
+    Event *event) {
+    auto & k = *kernel._kernel;
+    CG_IDBG(20, kLogTag, "Running kernel '%s' ... \n", k.name.c_str());
 
-    OCL_PROFILING_START("kernel_ALL", true);
-    OCL_PROFILING_START("kernel_" + kname, true);
+    _data->sync();
+
+    OCL_PROFILING_START("kernel_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START(k.profileId, _data->_deviceTiming == false);
 
     size_t local_item_size[2]  = {(size_t) localx,  (size_t) localy};
     size_t global_item_size[2] = {(size_t) globalx, (size_t) globaly};
+    const bool isLocal = localx > 0 && localy > 0;
 
     cl_int ret;
 
+    _data->prepare(waitList);
     ret = clEnqueueNDRangeKernel(
-              _data->_oclQueue, _kernels[kname].K,
-              2, NULL, global_item_size, local_item_size,
-              0, NULL, NULL);
+              _data->_oclQueue, k.target().K,
+              2, NULL, global_item_size, isLocal ? local_item_size : NULL,
+              _data->nWait(), _data->waitList(), _data->eventPtr(event));
     if (ret != CL_SUCCESS) {
-        throw Exception("Unable to run '%s' kernel. ret = %d", kname.c_str(), ret);
+        throw Exception("Unable to run '%s' kernel. ret = %d", k.name.c_str(), ret);
     }
+    if (_data->_deviceTiming) _data->timeCommand("kernel_ALL", k.profileId);
+    _data->track(waitList, event);
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_STOP("kernel_" + kname, true);
-    OCL_PROFILING_STOP("kernel_ALL", true);
+    OCL_PROFILING_STOP(k.profileId, _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("kernel_ALL", _data->_deviceTiming == false);
 }
 
-void BaseManager::acquireGLObject(const std::string &oname) {
+void BaseManager::acquireGLObject(
+    const std::string &oname,
+    const EventList *waitList,
+    Event *event) {
     cl_int ret;
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_START("oclGL_acquireObject_ALL", true);
-    OCL_PROFILING_START("oclGL_acquireObject_"+oname, true);
+    OCL_PROFILING_START("oclGL_acquireObject_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START("oclGL_acquireObject_"+oname, _data->_deviceTiming == false);
 
+    _data->prepare(waitList);
     ret = clEnqueueAcquireGLObjects(
-              _data->_oclQueue, 1, &_buffers[oname].V, 0, NULL, NULL);
+              _data->_oclQueue, 1, &_buffers[oname].V,
+              _data->nWait(), _data->waitList(), _data->eventPtr(event));
 
     if (ret != CL_SUCCESS) {
         throw Exception("Unable to acquire GL object '%s'. ret = %d",
                         oname.c_str(), ret);
     }
+    if (_data->_deviceTiming) _data->timeCommand("oclGL_acquireObject_ALL", "oclGL_acquireObject_"+oname);
+    _data->track(waitList, event);
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_STOP("oclGL_acquireObject_"+oname, true);
-    OCL_PROFILING_STOP("oclGL_acquireObject_ALL", true);
+    OCL_PROFILING_STOP("oclGL_acquireObject_"+oname, _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("oclGL_acquireObject_ALL", _data->_deviceTiming == false);
 }
 
-void BaseManager::releaseGLObject(const std::string &oname) {
+void BaseManager::releaseGLObject(
+    const std::string &oname,
+    const EventList *waitList,
+    Event *event) {
     cl_int ret;
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_START("oclGL_releaseObject_ALL", true);
-    OCL_PROFILING_START("oclGL_releaseObject_"+oname, true);
+    OCL_PROFILING_START("oclGL_releaseObject_ALL", _data->_deviceTiming == false);
+    OCL_PROFILING_START("oclGL_releaseObject_"+oname, _data->_deviceTiming == false);
 
+    _data->prepare(waitList);
     ret = clEnqueueReleaseGLObjects(
-              _data->_oclQueue, 1, &_buffers[oname].V, 0, NULL, NULL);
+              _data->_oclQueue, 1, &_buffers[oname].V,
+              _data->nWait(), _data->waitList(), _data->eventPtr(event));
 
     if (ret != CL_SUCCESS) {
         throw Exception("Unable to release GL object '%s'. ret = %d",
                         oname.c_str(), ret);
     }
+    if (_data->_deviceTiming) _data->timeCommand("oclGL_releaseObject_ALL", "oclGL_releaseObject_"+oname);
+    _data->track(waitList, event);
 
-    flush();
+    _data->sync();
 
-    OCL_PROFILING_STOP("oclGL_releaseObject_"+oname, true);
-    OCL_PROFILING_STOP("oclGL_releaseObject_ALL", true);
+    OCL_PROFILING_STOP("oclGL_releaseObject_"+oname, _data->_deviceTiming == false);
+    OCL_PROFILING_STOP("oclGL_releaseObject_ALL", _data->_deviceTiming == false);
 }
 
 void BaseManager::allocateOpenCLBuffer(
@@ -1135,19 +2321,59 @@ void BaseManager::allocateOpenCLBuffer(
     size_t        bufferSize,
     void         *bufferPtr
 ) {
-    cl_int ret;
-    if (_buffers[bname].V) deallocateOpenCLObject(bname);
+    cl_int ret = CL_SUCCESS;
+    auto & buffer = _buffers[bname];
+    if (buffer.V) deallocateOpenCLObject(bname);
 
     CG_IDBG(10, kLogTag, "Creating OpenCL buffer '%s'. Size = %g MB\n",
             bname.c_str(), ((float)bufferSize)/(1024*1024));
 
-    _buffers[bname].V = clCreateBuffer(
-            _data->_oclContext, _data->toCLFags(flags),
-            bufferSize, bufferPtr, &ret);
-    if (ret != CL_SUCCESS || !_buffers[bname].V) {
+    if ((flags & MEM_HOST_VISIBLE) && _data->getSelectedDevice().hostUnifiedMemory && bufferSize > 0) {
+        // the device works on page-aligned host memory in place, a multiple of the page in size
+        const size_t kPageSize = 4096;
+        const size_t capacity = ((bufferSize + kPageSize - 1)/kPageSize)*kPageSize;
+        void * host = nullptr;
+        if (posix_memalign(&host, kPageSize, capacity) != 0) {
+            throw OCL::Exception("Unable to allocate host memory for OpenCL buffer '%s'.", bname.c_str());
+        }
+        if ((flags & MEM_COPY_HOST_PTR) && bufferPtr) std::memcpy(host, bufferPtr, bufferSize);
+
+        buffer.pooled = false;
+        buffer.capacity = capacity;
+        buffer.V = clCreateBuffer(
+                _data->_oclContext, _data->toCLFags(flags & ~MEM_COPY_HOST_PTR) | CL_MEM_USE_HOST_PTR,
+                capacity, host, &ret);
+        ++buffer.generation;
+        if (ret != CL_SUCCESS || !buffer.V) {
+            free(host);
+            throw OCL::Exception("Unable to allocate OpenCL buffer '%s'. (ret = %d)",
+                                 bname.c_str(), ret);
+        }
+
+        buffer.host = host;
+        clSetMemObjectDestructorCallback(buffer.V, freeHostStorage, host);
+        return;
+    }
+
+    // the initial data is written after the allocation, so that the buffer can come from the pool
+    const bool isCopy = (flags & MEM_COPY_HOST_PTR) && bufferPtr;
+    buffer.flags = _data->toCLFags(flags & ~MEM_COPY_HOST_PTR);
+    buffer.pooled = bufferSize > 0 &&
+        (_data->allocateFromArena(buffer, bufferSize, buffer.flags) ||
+         _data->allocateFromPool(buffer, bufferSize, buffer.flags));
+
+    if (buffer.pooled == false) {
+        buffer.V = clCreateBuffer(
+                _data->_oclContext, _data->toCLFags(flags),
+                bufferSize, bufferPtr, &ret);
+    }
+    ++buffer.generation;
+    if (ret != CL_SUCCESS || !buffer.V) {
         throw OCL::Exception("Unable to allocate OpenCL buffer '%s'. (ret = %d)",
                              bname.c_str(), ret);
     }
+
+    if (buffer.pooled && isCopy) writeBuffer(bname, true, bufferSize, bufferPtr);
 }
 
 void BaseManager::allocateOpenCLTexture2D(
@@ -1162,6 +2388,7 @@ void BaseManager::allocateOpenCLTexture2D(
     _buffers[tname].V = clCreateFromGLTexture(
             _data->_oclContext, _data->toCLFags(flags),
             GL_TEXTURE_2D, 0, glTexId, &ret);
+    ++_buffers[tname].generation;
     if (ret != CL_SUCCESS || !_buffers[tname].V) {
         throw OCL::Exception("Unable to create CL texture object '%s' from GL texture.\n\
                   Either CL-GL interop was not requested when the OpenCL context was created or \n\
@@ -1199,6 +2426,7 @@ void BaseManager::allocateOpenCLImage3D(
     _buffers[iname].V = clCreateImage(
             _data->_oclContext, _data->toCLFags(flags),
             &img_fmt, &img_desc, bufferPtr, &ret);
+    ++_buffers[iname].generation;
     if (ret != CL_SUCCESS || !_buffers[iname].V) {
         throw Exception("[OCLM] Unable to create OpenCL GPU 3D Image '%s'. (ret = %d)", iname.c_str(), ret);
     }
@@ -1207,18 +2435,44 @@ void BaseManager::allocateOpenCLImage3D(
 void BaseManager::deallocateOpenCLObject(const std::string & bname) {
     CG_IDBG(10, kLogTag, "Deallocating OpenCL object '%s'\n", bname.c_str());
 
-    cl_int ret = clReleaseMemObject(_buffers[bname].V);
+    auto & buffer = _buffers[bname];
+    buffer.host = nullptr;
+    if (buffer.pooled) {
+        _data->recycle(buffer);
+        buffer.V = 0;
+        return;
+    }
+
+    cl_int ret = clReleaseMemObject(buffer.V);
+    buffer.V = 0;
     if (ret != CL_SUCCESS) {
         throw OCL::Exception("Unable to deallocate OpenCL object '%s'. (ret = %d)",
                 bname.c_str(), ret);
     }
 }
 
+void BaseManager::releaseBufferPool() {
+    for (auto & bucket : _data->_pool) {
+        for (auto V : bucket.second) clReleaseMemObject(V);
+    }
+    _data->_pool.clear();
+    _data->_pooledBytes = 0;
+}
+
 void BaseManager::checkSupport() {
     CG_IDBG(10, kLogTag, "Checking for supported features\n");
 
     flush();
 
+    {
+        cl_uint alignBits = 0;
+        clGetDeviceInfo(_data->_oclDevice, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(alignBits), &alignBits, NULL);
+        if (alignBits >= 8) _support.subBufferAlignment = alignBits/8;
+
+        CG_IDBG(10, kLogTag, " - sub-buffer alignment: %lu bytes\n", _support.subBufferAlignment);
+        CG_IDBG(10, kLogTag, " - host unified memory: %s\n", isHostUnifiedMemory() ? "Yes" : "No");
+    }
+
     {
         cl_int ret;
         std::string bname = "__support_clEnqueueFillBuffer";
@@ -1242,6 +2496,8 @@ void BaseManager::checkSupport() {
                     ret);
         }
 
+        flush();
+
         readBuffer(bname, CL_TRUE, bufSize, fbuf.data());
         deallocateOpenCLObject(bname);
 
@@ -1257,6 +2513,23 @@ void BaseManager::checkSupport() {
 
         CG_IDBG(10, kLogTag, " - clEnqueueFillBuffer: %s\n", isSupported ? "Yes" : "No");
     }
+
+    {
+        auto & selectedDevice = _data->getSelectedDevice();
+
+        size_t valueSize = 0;
+        clGetDeviceInfo(selectedDevice.deviceID, CL_DEVICE_EXTENSIONS, 0, NULL, &valueSize);
+        std::vector<char> extensions(valueSize + 1, 0);
+        clGetDeviceInfo(selectedDevice.deviceID, CL_DEVICE_EXTENSIONS, valueSize, extensions.data(), NULL);
+
+        _support.clCreateProgramWithIL = nullptr;
+        if (std::strstr(extensions.data(), "cl_khr_il_program")) {
+            _support.clCreateProgramWithIL = (OpenCLSupport::CreateProgramWithIL)
+                clGetExtensionFunctionAddressForPlatform(selectedDevice.platformID, "clCreateProgramWithILKHR");
+        }
+
+        CG_IDBG(10, kLogTag, " - clCreateProgramWithIL: %s\n", _support.clCreateProgramWithIL ? "Yes" : "No");
+    }
 }
 
 BaseManager::IKernel & BaseManager::getKernel(const std::string & kname) {
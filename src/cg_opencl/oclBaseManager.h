@@ -12,9 +12,15 @@
 #include <map>
 #include <memory>
 
+struct _cl_event;
+
 namespace OCL {
 
 class BaseManager {
+private:
+    struct Buffer;
+    struct Kernel;
+
 public: // Interfaces
 
     struct IDevice {
@@ -30,6 +36,58 @@ public: // Interfaces
     using KernelTree =
         std::map<std::string, std::vector<std::pair<std::string, std::string> > >;
 
+    // same type as cl_event
+    using Event = _cl_event *;
+    using EventList = std::vector<Event>;
+
+    // resolved once by name and valid for the lifetime of the manager. a buffer handle
+    // keeps referring to its buffer when the buffer is reallocated
+    class KernelHandle {
+    public:
+        KernelHandle() {}
+        bool isValid() const { return _kernel != nullptr; }
+
+    private:
+        friend class BaseManager;
+        explicit KernelHandle(Kernel *kernel) : _kernel(kernel) {}
+
+        Kernel *_kernel = nullptr;
+    };
+
+    class BufferHandle {
+    public:
+        BufferHandle() {}
+        bool isValid() const { return _buffer != nullptr; }
+
+    private:
+        friend class BaseManager;
+        explicit BufferHandle(Buffer *buffer) : _buffer(buffer) {}
+
+        Buffer *_buffer = nullptr;
+    };
+
+    // enqueues inside the scope are not waited for one by one - the queue is flushed
+    // and finished once when the outermost scope ends
+    class SubmissionScope {
+    public:
+        SubmissionScope(BaseManager & manager) : _manager(manager) { _manager.beginSubmission(); }
+        ~SubmissionScope() { _manager.endSubmission(); }
+
+    private:
+        BaseManager & _manager;
+    };
+
+    // the device time of the commands enqueued inside the scope is added to the counter
+    // once they have executed. scopes nest, the innermost counter gets the time
+    class TimingScope {
+    public:
+        TimingScope(BaseManager & manager, const std::string & counter) : _manager(manager) { _manager.beginTiming(counter); }
+        ~TimingScope() { _manager.endTiming(); }
+
+    private:
+        BaseManager & _manager;
+    };
+
 public: // Core
     BaseManager();
     virtual ~BaseManager();
@@ -46,6 +104,13 @@ public: // Core
         MEM_WRITE = 2,
         MEM_READ_WRITE = 3,
         MEM_COPY_HOST_PTR = 4,
+        MEM_HOST_VISIBLE = 8, // zero-copy on devices with host unified memory
+    };
+
+    enum MapFlags {
+        MAP_READ = 1,
+        MAP_WRITE = 2,
+        MAP_WRITE_INVALIDATE = 4,
     };
 
     virtual void configure(const std::string & fname);
@@ -55,16 +120,23 @@ public: // Core
 
     void listAvailableDevices(const int dtype) const;
     void listKernelInformation() const;
-    void initialize(DeviceType dtype, int did, bool clglInterop = false);
+    void initialize(DeviceType dtype, int did, bool clglInterop = false, bool outOfOrder = false);
 
     void addKernelToLoad(const char *fname, const char *kname, const char *kid);
 
+    // a variant takes the same arguments as the kernel kid and computes the same result
+    void addKernelVariant(const char *kid, const char *variantKid);
+
     virtual void loadKernels();
     virtual void allocateMemory();
 
     bool isInitialized() const;
     void setKernelPath(const std::string &kpath);
 
+    // program binaries are stored here keyed by a hash of the sources, build options and driver.
+    // an empty path always builds from source
+    void setBinaryCacheDir(const std::string &path);
+
     int getOptimumWorkgroups() const;
     int getOptimumWorkgroupSize() const;
     void setOptimumWorkgroups(const int nwg);
@@ -89,40 +161,135 @@ public: // Core
         const int aid,
         const std::string &bname);
 
+    KernelHandle getKernelHandle(const std::string &kname);
+    BufferHandle getBufferHandle(const std::string &bname);
+
+    // the kernels remember their arguments - a call that does not change the
+    // value, or the buffer bound to the argument, does not reach OpenCL
+    void setKernelArg(
+        const KernelHandle &kernel,
+        const int aid,
+        const int asize,
+        const void *a);
+
+    template <typename T>
+    void setKernelArg(
+        const KernelHandle &kernel,
+        const int aid,
+        const T &a) {
+        setKernelArg(kernel, aid, sizeof(a), (const void *)(&a));
+    }
+
+    void setKernelArgAsBuffer(
+        const KernelHandle &kernel,
+        const int aid,
+        const BufferHandle &buffer);
+
+    // overrides the default "autotune.cache" in the binary cache dir
+    void setTuningCacheFile(const std::string &fname);
+
+    // sweeps the workgroup count and size of the kernel and its variants on the work
+    // its current arguments describe and keeps the fastest for runKernelSelected.
+    // the kernel has to give the same result when it is run repeatedly. results are
+    // stored per device, driver, workload and problem size and reused without measuring.
+    // workload names the kind of input the arguments hold, results measured on different
+    // inputs are kept apart. every launch is waited for - call it at startup, not while rendering
+    void autotuneKernel(const KernelHandle &kernel, const int problemSize, const std::string &workload = "");
+
+    // applies the stored result of the nearest tuned problem size of the workload, never measures
+    void selectTunedKernel(const KernelHandle &kernel, const int problemSize, const std::string &workload = "");
+
     const KernelTree & getKernelTree() const;
     void printKernelTree() const;
 
     void flush();
     void finish();
 
+    void beginSubmission();
+    void endSubmission();
+    bool isOutOfOrder() const;
+
+    void beginTiming(const std::string &counter);
+    void endTiming();
+
+    // seconds collected by the counter since the last call. it never waits - commands that
+    // have not executed yet are counted by a later call
+    float takeTiming(const std::string &counter);
+
+    void waitForEvents(const EventList &events);
+    void releaseEvent(Event event);
+
+    // the enqueue calls below wait for the events in waitList. without a list they are
+    // ordered after all previous work, also on out-of-order queues. if event is given
+    // it receives the event of the command and has to be released by the caller
     void fillBufferFloat(
         const std::string &bname,
         const float f,
-        const int bsize);
+        const int bsize,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
 
     void writeBuffer(
         const std::string &bname,
         const bool block,
         const int bsize,
-        const void *bptr);
+        const void *bptr,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
+
+    // writes bsize bytes starting at offset
+    void writeBuffer(
+        const std::string &bname,
+        const bool block,
+        const int offset,
+        const int bsize,
+        const void *bptr,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
 
     void readBuffer(
         const std::string &bname,
         const bool block,
         const int bsize,
-        void *bptr);
+        void *bptr,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
+
+    // the host may access the returned memory until unmapBuffer. for MEM_HOST_VISIBLE
+    // buffers on devices with host unified memory nothing is copied
+    void * mapBuffer(
+        const std::string &bname,
+        const bool block,
+        const MapFlags flags,
+        const int offset,
+        const int bsize,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
+
+    void unmapBuffer(
+        const std::string &bname,
+        void *ptr,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
+
+    bool isHostUnifiedMemory() const;
+    bool isHostVisible(const std::string &bname) const;
 
     void copyBuffer(
         const std::string &srcname,
         const std::string &dstname,
-        const int bsize);
+        const int bsize,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
 
     void copyImage(
         const std::string &srcname,
         const std::string &dstname,
         const int nx,
         const int ny,
-        const int nz);
+        const int nz,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
 
     void writeImageFloat3D(
         const std::string &iname,
@@ -130,31 +297,75 @@ public: // Core
         const int nx,
         const int ny,
         const int nz,
-        void *bptr);
+        void *bptr,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
 
     void runKernel(
         const std::string &kname,
         const int nWorkgroups,
-        const int workgroupSize = -1);
+        const int workgroupSize = -1,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
+
+    void runKernel(
+        const KernelHandle &kernel,
+        const int nWorkgroups,
+        const int workgroupSize = -1,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
 
-    void runKernelSelected(const std::string &kname);
-    void runKernelOptimum(const std::string &kname);
+    void runKernelSelected(
+        const std::string &kname,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
+
+    void runKernelSelected(
+        const KernelHandle &kernel,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
+
+    void runKernelOptimum(
+        const std::string &kname,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
 
     void runKernelOptimum(
         const std::string &kname,
         const int nTotalWorkItems,
         const int nPerGroupAID,
-        const int nPerWorkitemAID);
+        const int nPerWorkitemAID,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
 
+    // a local size of 0 lets the implementation choose the workgroup
     void runKernel2D(
         const std::string &kname,
         const int globalx,
         const int globaly,
         const int localx,
-        const int localy);
+        const int localy,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
 
-    void acquireGLObject(const std::string &oname);
-    void releaseGLObject(const std::string &oname);
+    void runKernel2D(
+        const KernelHandle &kernel,
+        const int globalx,
+        const int globaly,
+        const int localx,
+        const int localy,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
+
+    void acquireGLObject(
+        const std::string &oname,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
+
+    void releaseGLObject(
+        const std::string &oname,
+        const EventList *waitList = nullptr,
+        Event *event = nullptr);
 
     void allocateOpenCLBuffer(
         const std::string  &bname,
@@ -180,16 +391,20 @@ public: // Core
         const CLFlags     flags,
         void             *bufferPtr = NULL);
 
+    // buffers from allocateOpenCLBuffer are sub-allocated from shared slabs when small or
+    // kept in a pool of size buckets when released, and reused by later allocations
     void deallocateOpenCLObject(const std::string & bname);
 
+    // frees the released buffers kept for reuse
+    void releaseBufferPool();
+
     IKernel & getKernel(const std::string & kname);
 
 private:
     void checkSupport();
 
-    struct Buffer;
     struct Device;
-    struct Kernel;
+    struct KernelArg;
     struct KernelContainer;
     struct BufferContainer;
     struct BuildConfiguration;
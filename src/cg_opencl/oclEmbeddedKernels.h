@@ -0,0 +1,25 @@
+/*! \file oclEmbeddedKernels.h
+ *  \brief Kernel sources compiled into the library at build time.
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace OCL {
+namespace EmbeddedKernels {
+struct Program {
+    const char * source;        // all quoted includes inlined
+    size_t sourceSize;
+
+    const unsigned char * il;   // SPIR-V, nullptr if it was not built
+    size_t ilSize;
+};
+
+// fname is relative to the kernel directory, e.g. "lights/GPU/lightning.cl".
+// returns nullptr if the file was not embedded
+const Program * find(const std::string & fname);
+}
+}
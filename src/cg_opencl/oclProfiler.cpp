@@ -50,14 +50,7 @@ void Profiler::stop(const int id) {
 
     float t = p->_timer->time();
     p->_isRunning = false;
-    p->_NN++;
-    if (p->_NN > p->_skip) {
-        p->_n++;
-        if (t < p->_min) p->_min = t;
-        if (t > p->_max) p->_max = t;
-        p->_sum += t;
-        p->_sum2 += t*t;
-    }
+    p->add(t);
 }
 
 void Profiler::print(const int id, const bool force) {
@@ -69,14 +62,15 @@ void Profiler::print(const int id, const bool force) {
     if (_printHeader) {
         _printHeader = false;
         _printFooter = true;
-        CG_INFO(0, "[T] Timing information: %41s %5s %9s %9s %9s +/- %9s %9s\n",
-                "", "N", "Min", "Max", "Avg", "DT", "Tot");
+        CG_INFO(0, "[T] Timing information: %41s %5s %9s %9s %9s +/- %9s %9s %9s\n",
+                "", "N", "Min", "Max", "Avg", "DT", "Tot", "Queued");
     }
 
     float avg   = (p->_n == 0) ? 0.0 : p->_sum / p->_n;
     float delta = (p->_n < 2)  ? 0.0 : sqrt(p->_sum2/p->_n - avg*avg);
-    CG_INFO(0, "[T] Profiler %44d for '%s': %5d %9.4f %9.4f %9.5f +/- %9.4f %9.4f\n",
-            id, p->_title.c_str(), p->_n, p->_min, p->_max, avg, delta, p->_sum);
+    float queued = (p->_nQueued == 0) ? 0.0 : p->_queuedSum / p->_nQueued;
+    CG_INFO(0, "[T] Profiler %44d for '%s': %5d %9.4f %9.4f %9.5f +/- %9.4f %9.4f %9.5f\n",
+            id, p->_title.c_str(), p->_n, p->_min, p->_max, avg, delta, p->_sum, queued);
 }
 
 // Profilers Str
@@ -112,15 +106,17 @@ void Profiler::stop(const std::string &id) {
 
     float t = p->_timer->time();
     p->_isRunning = false;
-    p->_NN++;
-
-    if (p->_NN > p->_skip) {
-        p->_n++;
-        if (t < p->_min) p->_min = t;
-        if (t > p->_max) p->_max = t;
-        p->_sum += t;
-        p->_sum2 += t*t;
-    }
+    p->add(t);
+}
+
+void Profiler::record(const std::string &id, const float t, const float queued) {
+    auto it = _profilersStr.find(id);
+    if (it == _profilersStr.end() || !it->second) return;
+
+    PrivateProfiler *p = it->second;
+    p->add(t);
+    p->_nQueued++;
+    p->_queuedSum += queued;
 }
 
 void Profiler::print(const std::string &id, const bool force) {
@@ -132,14 +128,15 @@ void Profiler::print(const std::string &id, const bool force) {
     if (_printHeader) {
         _printHeader = false;
         _printFooter = true;
-        CG_INFO(0, "[T] Timing information: %41s %5s %9s %9s %9s +/- %9s %9s\n",
-                "", "N", "Min", "Max", "Avg", "DT", "Tot");
+        CG_INFO(0, "[T] Timing information: %41s %5s %9s %9s %9s +/- %9s %9s %9s\n",
+                "", "N", "Min", "Max", "Avg", "DT", "Tot", "Queued");
     }
 
     float avg   = (p->_n == 0) ? 0.0 : p->_sum / p->_n;
     float delta = (p->_n < 2)  ? 0.0 : sqrt(p->_sum2/p->_n - avg*avg);
-    CG_INFO(0, "[T] Profiler %44s for '%s': %5d %9.4f %9.4f %9.5f +/- %9.4f %9.4f\n",
-            id.c_str(), p->_title.c_str(), p->_n, p->_min, p->_max, avg, delta, p->_sum);
+    float queued = (p->_nQueued == 0) ? 0.0 : p->_queuedSum / p->_nQueued;
+    CG_INFO(0, "[T] Profiler %44s for '%s': %5d %9.4f %9.4f %9.5f +/- %9.4f %9.4f %9.5f\n",
+            id.c_str(), p->_title.c_str(), p->_n, p->_min, p->_max, avg, delta, p->_sum, queued);
 }
 
 void Profiler::printAll(const bool force) {
@@ -196,6 +193,20 @@ void Profiler::PrivateProfiler::reset() {
     _max = 0.0;
     _sum = 0.0;
     _sum2 = 0.0;
+
+    _nQueued = 0;
+    _queuedSum = 0.0;
+}
+
+void Profiler::PrivateProfiler::add(const float t) {
+    _NN++;
+    if (_NN > _skip) {
+        _n++;
+        if (t < _min) _min = t;
+        if (t > _max) _max = t;
+        _sum += t;
+        _sum2 += t*t;
+    }
 }
 
 Profiler::PrivateProfiler::~PrivateProfiler() {
@@ -15,6 +15,7 @@
     #define OCL_PROFILING_SET_PARAMETERS(ID, TITLE, FREQ, SKIP) _OCL_P_.setParams(ID, TITLE, FREQ, SKIP);
     #define OCL_PROFILING_START(ID, COND) if (COND) _OCL_P_.start(ID);
     #define OCL_PROFILING_STOP(ID, COND) if (COND) _OCL_P_.stop(ID);
+    #define OCL_PROFILING_RECORD(ID, T, QUEUED) _OCL_P_.record(ID, T, QUEUED);
     #define OCL_PROFILING_PRINT(ID, FORCE) _OCL_P_.print(ID, FORCE);
     #define OCL_PROFILING_PRINT_ALL(FORCE) _OCL_P_.printAll(FORCE);
     #define OCL_PROFILING_PRINT_ALL_COND(COND) if (COND) _OCL_P_.printAll(true);
@@ -23,6 +24,7 @@
     #define OCL_PROFILING_SET_PARAMETERS(ID, TITLE, FREQ, SKIP)
     #define OCL_PROFILING_START(ID, COND)
     #define OCL_PROFILING_STOP(ID, COND)
+    #define OCL_PROFILING_RECORD(ID, T, QUEUED)
     #define OCL_PROFILING_PRINT(ID, FORCE)
     #define OCL_PROFILING_PRINT_ALL(FORCE)
     #define OCL_PROFILING_PRINT_ALL_COND(COND)
@@ -53,6 +55,10 @@ public:
     void stop     (const std::string &id);
     void print    (const std::string &id, const bool force = false);
 
+    // adds a measurement taken elsewhere, e.g. the execution time of an OpenCL command
+    // and the time it waited in the queue before it started
+    void record   (const std::string &id, const float t, const float queued);
+
     void printAll (const bool force = false);
 
     void resetAll();
@@ -65,6 +71,7 @@ private:
         ~PrivateProfiler();
 
         void reset();
+        void add(const float t);
 
         bool _isRunning;
 
@@ -78,6 +85,9 @@ private:
         float _sum;
         float _sum2;
 
+        int _nQueued;
+        float _queuedSum;
+
         std::string _title;
 
         CG::Timer *_timer;